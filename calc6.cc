@@ -5,13 +5,103 @@
 // Copyright (C) 2017, Consolidated Braincells Inc.  All rights reserved.
 // "Do what thou wilt shall be the whole of the license."
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// USDT probes for bpftrace and the like, where <sys/sdt.h> is to be had.
+// Each is a nop until something attaches to it; bpftrace -l 'usdt:./calc6'
+// lists them, as does readelf -n calc6 under .note.stapsdt.  Without the
+// header they compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifdef DTRACE_PROBE
+#define PROBE0(name) DTRACE_PROBE(calc6, name)
+#define PROBE1(name, a) DTRACE_PROBE1(calc6, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(calc6, name, a, b)
+#else
+#define PROBE0(name) do {} while (0)
+#define PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#endif
 using namespace std;
 
+// Throw an error message followed by detail.  The message is kept in a fixed
+// thread local buffer so the pointer is still valid by the time a handler
+// gets to look at it, and so that raising an error needn't allocate.
+[[noreturn]] void error(const char* message, const char* detail = "") {
+    static thread_local char buffer[256];
+    size_t length = min(strlen(message), sizeof(buffer) - 1);
+    memmove(buffer, message, length);   // message may be a rethrown buffer
+    size_t more = min(strlen(detail), sizeof(buffer) - 1 - length);
+    memmove(buffer + length, detail, more);
+    buffer[length + more] = '\0';
+    throw(static_cast<const char*>(buffer));
+}
+
+// Throw an error message built at run time.
+[[noreturn]] void error(const string& message) {
+    error(message.c_str());
+}
+
+// Read text as a decimal number no bigger than limit into value.  Returns
+// false unless text is nothing but digits; there is no sign to get wrapped
+// around.
+bool parse_number(const char* text, unsigned long limit,
+unsigned long& value) {
+    if (!isdigit(static_cast<unsigned char>(*text))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    value = strtoul(text, &end, 10);
+    return *end == '\0' && errno == 0 && value <= limit;
+}
+
 // Token types
 enum class TOKENTYPE {
     ENDOFFILE = 0, // EOF can't be used as it is already defined in std
@@ -23,40 +113,37 @@ enum class TOKENTYPE {
     MUL,
     DIV,
     LPAREN,
-    RPAREN
+    RPAREN,
+    SEMI            // separates expressions on one line
 };
 
-ostream& operator<<(ostream& out, const TOKENTYPE& t) {
-    string repr;
+// The name of a token type, as a static string.
+const char* name(TOKENTYPE t) {
     switch(t) {
         case TOKENTYPE::ENDOFFILE:
-            repr = "ENDOFFILE";
-            break;
+            return "ENDOFFILE";
         case TOKENTYPE::INTEGER:
-            repr = "INTEGER";
-            break;
+            return "INTEGER";
         case TOKENTYPE::PLUS:
-            repr = "PLUS";
-            break;
+            return "PLUS";
         case TOKENTYPE::MINUS:
-            repr = "MINUS";
-            break;
+            return "MINUS";
         case TOKENTYPE::MUL:
-            repr = "MUL";
-            break;
+            return "MUL";
         case TOKENTYPE::DIV:
-            repr = "DIV";
-            break;
+            return "DIV";
         case TOKENTYPE::LPAREN:
-            repr = "LPAREN";
-            break;
+            return "LPAREN";
         case TOKENTYPE::RPAREN:
-            repr = "RPAREN";
-            break;
+            return "RPAREN";
+        case TOKENTYPE::SEMI:
+            return "SEMI";
     }
+    return "";
+}
 
-    out << repr;
-    return out;
+ostream& operator<<(ostream& out, const TOKENTYPE& t) {
+    return out << name(t);
 }
 
 struct Token {
@@ -79,237 +166,6171 @@ ostream& operator<<(ostream& out, const Token& t) {
     return out;
 }
 
-class Lexer {
+// A timestamp for --stats.  On x86 this is the time stamp counter, which is
+// much cheaper to read than the clock; elsewhere it is in nanoseconds.
+uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 +
+        static_cast<uint64_t>(now.tv_nsec);
+#endif
+}
+
+// A log-linear histogram.  Values under 16 have a bucket each; above that
+// each power of two is split into 8 buckets so a value is never more than an
+// eighth out.
+class Histogram {
 public:
-    Lexer(string& text);
-    Token get_next_token();
-    long  integer();
+    Histogram();
+    void        add(uint64_t value);
+    void        merge(const Histogram& other);
+    uint64_t    count() const;
+    uint64_t    percentile(double p) const;
 private:
-    string& _text;          // client string input, e.g. "3+5"
-    size_t  _pos;           // an index into _text
-    char    _current_char;  // the character at _text[_pos]
+    static const size_t BUCKETS = 16 + 60 * 8;
 
-    void  advance();
-    void  skip_whitespace();
+    uint64_t    _counts[BUCKETS];
+    uint64_t    _count;
+
+    static size_t   bucket(uint64_t value);
+    static uint64_t middle(size_t bucket);
 };
 
 // Constructor
-Lexer::Lexer(string& text) : _text{text}, _pos{0}, _current_char{_text[_pos]} {
+Histogram::Histogram() : _counts{}, _count{0} {
 }
 
-// Lexical analyzer (also known as scanner or tokenizer)
-//
-// This method is responsible for breaking a sentence apart into tokens. One
-// token at a time.
-//
-Token Lexer::get_next_token() {
+void Histogram::add(uint64_t value) {
+    _counts[bucket(value)]++;
+    _count++;
+}
 
-    while (_current_char != '\0') {
+void Histogram::merge(const Histogram& other) {
+    for (size_t i = 0; i < BUCKETS; i++) {
+        _counts[i] += other._counts[i];
+    }
+    _count += other._count;
+}
 
-        if (isspace(_current_char)) {
-            skip_whitespace();
-            continue;
-        }
+uint64_t Histogram::count() const {
+    return _count;
+}
 
-        if (isdigit(_current_char)) {
-            Token token(TOKENTYPE::INTEGER, integer());
-            cerr << token << endl;
-            return token;
-        }
+// The value which a fraction p of those added are no greater than, give or
+// take the width of its bucket.
+uint64_t Histogram::percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(p * _count + 0.5);
+    uint64_t seen = 0;
 
-        if (_current_char == '*') {
-            advance();
-            Token token(TOKENTYPE::MUL, '*');
-            cerr << token << endl;
-            return token;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += _counts[i];
+        if (seen >= max<uint64_t>(rank, 1)) {
+            return middle(i);
         }
+    }
 
-        if (_current_char == '/') {
-            advance();
-            Token token(TOKENTYPE::DIV, '/');
-            cerr << token << endl;
-            return token;
-        }
+    return 0;
+}
 
-        if (_current_char == '+') {
-            advance();
-            Token token(TOKENTYPE::PLUS, '+');
-            cerr << token << endl;
-            return token;
-        }
+size_t Histogram::bucket(uint64_t value) {
+    if (value < 16) {
+        return value;
+    }
+    size_t e = 63 - static_cast<size_t>(__builtin_clzll(value));
+    return 16 + (e - 4) * 8 + ((value >> (e - 3)) & 7);
+}
 
-        if (_current_char == '-') {
-            advance();
-            Token token(TOKENTYPE::MINUS, '-');
-            cerr << token << endl;
-            return token;
-        }
+// The value in the middle of a bucket.
+uint64_t Histogram::middle(size_t bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    size_t e = (bucket - 16) / 8 + 4;
+    uint64_t width = 1ULL << (e - 3);
+    return (8 + (bucket - 16) % 8) * width + width / 2;
+}
 
-        if (_current_char == '(') {
-            advance();
-            Token token(TOKENTYPE::LPAREN, '(');
-            cerr << token << endl;
-            return token;
-        }
+// A build with COUNT_ALLOCATIONS defined (make calc6-alloc) counts every
+// allocation for --stats and can check that there are none with
+// --assert-no-alloc.
+#ifdef COUNT_ALLOCATIONS
+const bool COUNTING_ALLOCATIONS = true;
+#else
+const bool COUNTING_ALLOCATIONS = false;
+#endif
 
-        if (_current_char == ')') {
-            advance();
-            Token token(TOKENTYPE::RPAREN, ')');
-            cerr << token << endl;
-            return token;
-        }
+void report();
 
-        ostringstream out;
-        out << "Error parsing input. Got: " << _current_char;
-        throw(out.str().c_str());
+// Have SIGUSR1 ask for --stats and --trace to be written out there and then,
+// even if every other thread is waiting for input, by a thread which does
+// nothing but wait for it.  This must be called before any other thread is
+// started so that they all inherit SIGUSR1 blocked.
+void report_on_signal() {
+    static once_flag once;
+    call_once(once, [] {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        thread([signals] {
+            int signal;
+            while (sigwait(&signals, &signal) == 0) {
+                report();
+            }
+        }).detach();
+    });
+}
+
+// Records spans of time taken by each line, each phase of it and, if calls
+// is set, each token lexed and each call of expression(), term() and
+// factor(), to be written out as Chrome trace-event JSON which Perfetto or
+// chrome://tracing can show on a timeline.  Each thread has its own buffer.
+// Spans go into a part of it only that thread touches and are moved to where
+// they can be written out at the end of each line.  Each span is a complete
+// event rather than a begin and an end so when a buffer is full and spans are
+// dropped, the rest still make sense.
+class Trace {
+public:
+    // Records a span from construction to destruction.
+    class Span {
+    public:
+        Span(const char* name, bool call = false);
+        ~Span();
+    private:
+        const char* _name;
+        int64_t     _start;     // -1 if not tracing
+    };
+
+    static bool     enabled;
+    static bool     calls;
+    static void     start(const string& path, bool calls);
+    static int64_t  now();
+    static void     record(const char* name, int64_t start);
+    static void     flush();
+    static void     write();
+private:
+    static const size_t LIMIT = 1 << 22;    // most spans kept per thread
+
+    struct Event {
+        const char* name;
+        int64_t     start;      // nanoseconds since the trace started
+        int64_t     duration;
+    };
+
+    // The spans of a thread.
+    struct Spans {
+        size_t          tid;
+        size_t          dropped;
+        vector<Event>   events;
+    };
+
+    // A thread's buffer.
+    struct Buffer {
+        Buffer();
+        ~Buffer();
+
+        vector<Event>   pending;    // only touched by the thread
+        Spans           spans;      // under lock
+        mutex           lock;
+    };
+
+    static Buffer&  local();
+    static void     write(ostream& out, const Spans& spans, long pid,
+                        const char*& comma);
+
+    static string                       _path;
+    static chrono::steady_clock::time_point _origin;
+    static mutex                        _all_lock;
+    static vector<Buffer*>              _all;       // of every thread
+    static vector<Spans>                _retired;   // of finished threads
+    static size_t                       _threads;   // buffers made so far
+};
+
+bool Trace::enabled = false;
+bool Trace::calls = false;
+string Trace::_path;
+chrono::steady_clock::time_point Trace::_origin;
+mutex Trace::_all_lock;
+vector<Trace::Buffer*> Trace::_all;
+vector<Trace::Spans> Trace::_retired;
+size_t Trace::_threads = 0;
+
+// Constructor.  A call is only traced if calls are.
+Trace::Span::Span(const char* name, bool call) : _name{name}, _start{-1} {
+    if (call ? calls : enabled) {
+        _start = now();
     }
+}
 
-    Token token(TOKENTYPE::ENDOFFILE, '\0');
-    cerr << token << endl;
-    return token;
+// Destructor
+Trace::Span::~Span() {
+    if (_start >= 0) {
+        record(_name, _start);
+    }
 }
 
-// Return a (multidigit) integer consumed from the input.
-long Lexer::integer() {
-    string result("");
+// Constructor
+Trace::Buffer::Buffer() : pending{}, spans{0, 0, {}}, lock{} {
+    lock_guard<mutex> guard(_all_lock);
+    spans.tid = ++_threads;
+    _all.push_back(this);
+}
 
-    while (_current_char != '\0' && isdigit(_current_char)) {
-        result += _current_char;
-        advance();
+// Destructor.  The spans are handed over to be written out later.
+Trace::Buffer::~Buffer() {
+    lock_guard<mutex> guard(_all_lock);
+    _all.erase(find(_all.begin(), _all.end(), this));
+    spans.events.insert(spans.events.end(), pending.begin(), pending.end());
+    _retired.push_back(move(spans));
+}
+
+// Start tracing, to be written to the file at path.
+void Trace::start(const string& path, bool calls) {
+    _path = path;
+    _origin = chrono::steady_clock::now();
+    Trace::calls = calls;
+    enabled = true;
+    report_on_signal();
+}
+
+// Nanoseconds since tracing started.
+int64_t Trace::now() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - _origin).count();
+}
+
+// Record a span called name which started at start and ends now.
+void Trace::record(const char* name, int64_t start) {
+    Buffer& buffer = local();
+    if (buffer.pending.size() + buffer.spans.events.size() >= LIMIT) {
+        buffer.spans.dropped++;
+        return;
     }
+    buffer.pending.push_back(Event{name, start, now() - start});
+}
 
-    return stol(result);
+// Make this thread's spans so far available to write().
+void Trace::flush() {
+    if (!enabled) {
+        return;
+    }
+    Buffer& buffer = local();
+    lock_guard<mutex> guard(buffer.lock);
+    buffer.spans.events.insert(buffer.spans.events.end(),
+        buffer.pending.begin(), buffer.pending.end());
+    buffer.pending.clear();
 }
 
-// Advance the '_pos' pointer and set the '_current_char' variable.
-void Lexer::advance() {
-    _pos++;
-    if (_pos > _text.length() - 1) {
-        _current_char = '\0';   // Indicates end of input
-    } else {
-        _current_char = _text[_pos];
+Trace::Buffer& Trace::local() {
+    static thread_local Buffer buffer;
+    return buffer;
+}
+
+// Write every span so far to the trace file.
+void Trace::write() {
+    ofstream out(_path);
+    if (!out) {
+        cerr << "Can't write " << _path << ": " << strerror(errno) << endl;
+        return;
+    }
+
+    flush();
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" << fixed
+        << setprecision(3);
+    const char* comma = "";
+    long pid = static_cast<long>(getpid());
+
+    lock_guard<mutex> guard(_all_lock);
+    for (auto buffer : _all) {
+        lock_guard<mutex> buffer_guard(buffer->lock);
+        write(out, buffer->spans, pid, comma);
+    }
+    for (auto& spans : _retired) {
+        write(out, spans, pid, comma);
     }
+    out << "\n]}\n";
 }
 
-// Skip leading white space.
-void Lexer::skip_whitespace() {
-    while (_current_char != '\0' && isspace(_current_char)) {
-        advance();
+// Write the events for one thread's spans, each but the first preceded by
+// comma.
+void Trace::write(ostream& out, const Spans& spans, long pid,
+const char*& comma) {
+    out << comma << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"
+        << pid << ",\"tid\":" << spans.tid
+        << ",\"args\":{\"name\":\"thread " << spans.tid << "\"";
+    if (spans.dropped) {
+        out << ",\"dropped\":" << spans.dropped;
+    }
+    out << "}}";
+    comma = ",\n";
+
+    for (auto& event : spans.events) {
+        out << comma << "{\"name\":\"" << event.name
+            << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":"
+            << spans.tid << ",\"ts\":" << event.start / 1000.0
+            << ",\"dur\":" << event.duration / 1000.0 << "}";
     }
 }
 
-class Interpreter {
+// What --stats finds out about each line: how long it took and how many
+// tokens and nodes it had.  Reading the timer around every token would cost
+// more than lexing it so only one line in SAMPLE is split up into phases.
+// Each thread has its own Stats so nothing is shared while timing; they are
+// put together when reported, which happens on SIGUSR1 as well as at the
+// end.
+//
+// If allocations are being counted, Timers and Lines keep track of which
+// phase each thread is in whether or not the line is sampled, so that every
+// allocation can be put down to one.
+//
+// With counters, each thread also has a group of hardware performance
+// counters for each phase, which only count while a sampled line is in that
+// phase.  Switching them on and off is a system call per token, which slows
+// sampled lines down a lot, so this is only done if asked for.
+//
+// With --slow-log every line is split up into phases, and any which takes
+// longer than the threshold to lex, parse and evaluate is written to a log
+// of its own, no more than so many a second.
+class Stats {
 public:
-    Interpreter(Lexer& lexer);
-    long expression();
+    enum PHASE {
+        LEX,
+        PARSE,      // for Interpreter, which evaluates as it parses, this
+                    // includes evaluation
+        EVAL,
+        OUTPUT,
+        LINE,       // the whole line
+        PHASES
+    };
+
+    // Times a phase from construction to destruction, if the line is being
+    // sampled.  Time taken by other Timers in the meantime belongs to their
+    // phases and is left out.  It is traced too, sampled or not.
+    class Timer {
+    public:
+        Timer(PHASE phase);
+        ~Timer();
+    private:
+        Trace::Span _span;
+        Stats*      _stats;     // nullptr if not timing
+        PHASE       _phase;
+        PHASE       _previous;  // the phase the thread was in before this
+        PHASE       _outer;     // the phase being counted before this one
+        uint64_t    _nested;    // _stats->_inner at the start
+        uint64_t    _enter;     // before switching counters
+        uint64_t    _start;     // after
+    };
+
+    // Times and traces a line and adds what its phases took to the
+    // histograms.
+    class Line {
+    public:
+        Line(const string* text = nullptr);
+        ~Line();
+    private:
+        Stats*          _stats;
+        const string*   _text;
+        uint64_t        _start;
+        int64_t         _traced;    // when the trace span started, or -1
+    };
+
+    Stats();
+    ~Stats();
+
+    static void         token(TOKENTYPE type);
+    static void         allocated(size_t size);
+    static const char*  name(PHASE phase);
+
+    static bool     assert_no_alloc;
+    static bool     enabled;
+    static bool     reporting;      // not just for --slow-log
+    static void     start(bool counters);
+    static void     log_slow(uint64_t threshold, int fd, size_t rate);
+    static Stats&   local();
+    static void     dump(ostream& out);
 private:
-    Lexer&  _lexer;
-    Token   _current_token; // current token instance
+    static const uint64_t SAMPLE = 16;
+    static const size_t COUNTED = LINE;     // phases with counters
+    static const size_t EVENTS = 5;
+    static const uint64_t WARMUP = 1000;    // lines a thread may allocate in
+                                            // with --assert-no-alloc
+    static const size_t SLOWTEXT = 80;      // bytes of a slow line logged
 
-    void  eat(TOKENTYPE token_type);
-    long  factor();
-    long  term();
+    // What is reported.
+    struct Figures {
+        Histogram   histograms[PHASES];     // nanoseconds per line
+        uint64_t    lines;
+        uint64_t    sampled;
+        uint64_t    tokens;
+        uint64_t    nodes;
+        uint64_t    events[COUNTED][EVENTS];
+        uint64_t    allocations[PHASES];    // LINE: not in any phase
+        uint64_t    allocated[PHASES];      // bytes
+
+        void    merge(const Figures& other);
+    };
+
+    uint64_t        _spent[PHASES];     // ticks taken by each phase so far
+                                        // in the current line
+    unsigned        _seen;              // which phases the line has had
+    uint64_t        _inner;             // ticks taken by all Timers
+    PHASE           _counting;          // PHASES if none
+    int             _counters[COUNTED]; // group leaders, or -1
+    int             _members[COUNTED][EVENTS];
+    Figures         _figures;
+    mutex           _lock;              // for when the stats are reported
+
+    void    count(PHASE phase, bool on);
+    void    collect();
+    string  slow(const string* text);
+
+    static int      open_counter(size_t event, int group);
+    static void     log(const string& entry);
+
+    static double                   _ns_per_tick;
+    static uint64_t                 _overhead;  // ticks taken by the timer
+    static bool                     _counted;   // counters are wanted
+    static thread_local Stats*      _timing;    // set while sampling a line
+    static thread_local uint64_t    _tokens;    // in the current line
+    static thread_local uint64_t    _nodes;
+    static thread_local PHASE       _where;     // PHASES if not in a line
+    static thread_local uint64_t    _allocations[PHASES + 1];   // in the
+    static thread_local uint64_t    _allocated[PHASES + 1];     // line
+    static thread_local uint64_t    _lines;     // finished by this thread
+    static mutex                    _all_lock;
+    static vector<Stats*>           _all;       // of every thread
+    static Figures                  _retired;   // of threads which have
+                                                // finished
+    static uint64_t                 _slow_ns;   // 0 if not logging
+    static int                      _slow_fd;
+    static size_t                   _slow_rate; // entries a second
+    static atomic<uint64_t>         _slow_second;
+    static atomic<size_t>           _slow_logged;   // in _slow_second
+    static atomic<size_t>           _slow_dropped;  // since the last entry
 };
 
-// Constructor
-Interpreter::Interpreter(Lexer& lexer) : _lexer{lexer},
-_current_token{_lexer.get_next_token()} {
+bool Stats::enabled = false;
+bool Stats::reporting = false;
+double Stats::_ns_per_tick = 1.0;
+uint64_t Stats::_overhead = 0;
+bool Stats::_counted = false;
+thread_local Stats* Stats::_timing = nullptr;
+thread_local uint64_t Stats::_tokens = 0;
+thread_local uint64_t Stats::_nodes = 0;
+thread_local Stats::PHASE Stats::_where = Stats::PHASES;
+thread_local uint64_t Stats::_allocations[PHASES + 1];
+thread_local uint64_t Stats::_allocated[PHASES + 1];
+thread_local uint64_t Stats::_lines = 0;
+bool Stats::assert_no_alloc = false;
+mutex Stats::_all_lock;
+vector<Stats*> Stats::_all;
+Stats::Figures Stats::_retired;
+const size_t Stats::SLOWTEXT;
+uint64_t Stats::_slow_ns = 0;
+int Stats::_slow_fd = STDERR_FILENO;
+size_t Stats::_slow_rate = 0;
+atomic<uint64_t> Stats::_slow_second{0};
+atomic<size_t> Stats::_slow_logged{0};
+atomic<size_t> Stats::_slow_dropped{0};
+
+// Constructor.  The time taken to switch counters is left out of this
+// phase but not out of what an outer phase is told this one took, so it
+// doesn't count against either.
+Stats::Timer::Timer(PHASE phase) : _span{name(phase), phase == LEX},
+_stats{_timing}, _phase{phase}, _previous{_where}, _outer{PHASES},
+_nested{0}, _enter{0}, _start{0} {
+    if (COUNTING_ALLOCATIONS) {
+        _where = phase;
+    }
+    if (_stats) {
+        _nested = _stats->_inner;
+        _enter = ticks();
+        if (_counted) {
+            _outer = _stats->_counting;
+            _stats->count(_outer, false);
+            _stats->count(_phase, true);
+        }
+        _start = _counted ? ticks() : _enter;
+    }
 }
 
-// Arithmetic expression parser / interpreter.
-// expr    : term ((PLUS | MINUS) term)*
-// term    : factor ((MUL | DIV) factor)*
-// factor  : INTEGER | LPAREN expr RPAREN
-long Interpreter::expression() {
-    long result = term();
+// Destructor
+Stats::Timer::~Timer() {
+    if (COUNTING_ALLOCATIONS) {
+        _where = _previous;
+    }
+    if (_stats == nullptr) {
+        return;
+    }
 
-    while (_current_token.type == TOKENTYPE::PLUS ||
-    _current_token.type == TOKENTYPE::MINUS) {
-        Token token = _current_token;
-        if (token.type == TOKENTYPE::PLUS) {
-            eat(TOKENTYPE::PLUS);
-            result += term();
-        } else if (token.type == TOKENTYPE::MINUS) {
-            eat(TOKENTYPE::MINUS);
-            result -= term();
-        }
+    uint64_t end = ticks();
+    uint64_t exit = end;
+    if (_counted) {
+        _stats->count(_phase, false);
+        _stats->count(_outer, true);
+        exit = ticks();
     }
 
-    return result;
+    uint64_t elapsed = end - _start;
+    elapsed = elapsed > _overhead ? elapsed - _overhead : 0;
+    uint64_t inner = _stats->_inner - _nested;
+    _stats->_spent[_phase] += elapsed > inner ? elapsed - inner : 0;
+    _stats->_inner = _nested + (exit - _enter);
+    _stats->_seen |= 1u << _phase;
 }
 
-// compare the current token type with the passed token type and if they match
-// then "eat" the current token and assign the next token to _current_token,
-// otherwise raise an exception.
-void Interpreter::eat(TOKENTYPE token_type) {
-    if (_current_token.type == token_type) {
-        _current_token = _lexer.get_next_token();
-    } else {
-        ostringstream out;
-        out << "Error parsing input. Wanted: " << token_type;
-        throw(out.str().c_str());
+// Constructor
+Stats::Line::Line(const string* text) : _stats{nullptr}, _text{text},
+_start{0}, _traced{Trace::enabled ? Trace::now() : -1} {
+    PROBE2(line__start, text ? text->data() : nullptr,
+        text ? text->length() : 0);
+    if (COUNTING_ALLOCATIONS) {
+        _where = LINE;
+    }
+    if (enabled) {
+        _stats = &local();
+        if (_stats->_figures.lines % SAMPLE == 0 || _slow_ns) {
+            _timing = _stats;
+        }
+        _start = ticks();
     }
 }
 
-// factor : INTEGER | LPAREN expr RPAREN
-long Interpreter::factor() {
-    Token token = _current_token;
-    
-    if (token.type == TOKENTYPE::INTEGER) {
-        eat(TOKENTYPE::INTEGER);
-        return token.value;
-    } else if (token.type == TOKENTYPE::LPAREN) {
-        eat(TOKENTYPE::LPAREN);
-        long result = expression();
-        eat(TOKENTYPE::RPAREN);
-        return result;
-    } else {
-        ostringstream out;
-        out << "Error parsing input. Wanted: Integer or (";
-        throw(out.str().c_str());
+// Destructor
+Stats::Line::~Line() {
+    PROBE0(line__done);
+    if (COUNTING_ALLOCATIONS) {
+        _where = PHASES;
+        _lines++;
+    }
+    string entry;       // for the slow log, written once the lock is free
+    if (_stats) {
+        lock_guard<mutex> guard(_stats->_lock);
+        _stats->_spent[LINE] = ticks() - _start;
+        if (_timing) {
+            _stats->_seen |= 1u << LINE;
+            _stats->_figures.sampled++;
+        } else {
+            _stats->_seen = 1u << LINE;
+        }
+        _timing = nullptr;
+        if (_slow_ns && (_stats->_spent[LINE] - _stats->_spent[OUTPUT]) *
+        _ns_per_tick >= _slow_ns) {
+            entry = _stats->slow(_text);
+        }
+        for (size_t i = 0; i < PHASES; i++) {
+            if (_stats->_seen & (1u << i)) {
+                _stats->_figures.histograms[i].add(static_cast<uint64_t>(
+                    _stats->_spent[i] * _ns_per_tick));
+            }
+            _stats->_spent[i] = 0;
+        }
+        _stats->_seen = 0;
+        _stats->_figures.lines++;
+        _stats->_figures.tokens += _tokens;
+        _stats->_figures.nodes += _nodes;
+        _tokens = _nodes = 0;
+        for (size_t i = 0; i < PHASES; i++) {
+            _stats->_figures.allocations[i] += _allocations[i];
+            _stats->_figures.allocated[i] += _allocated[i];
+            _allocations[i] = _allocated[i] = 0;
+        }
+    }
+    if (!entry.empty()) {
+        log(entry);
+    }
+
+    if (_traced >= 0) {
+        Trace::record("line", _traced);
+        Trace::flush();
     }
 }
 
-// term : factor ((MUL | DIV) factor)*
-long Interpreter::term() {
-    long result = factor();
-                                                                      
-    while (_current_token.type == TOKENTYPE::MUL
-    || _current_token.type == TOKENTYPE::DIV) {
-        Token token = _current_token;
-        if (token.type == TOKENTYPE::MUL) {
-            eat(TOKENTYPE::MUL);
-            result *= factor();
-        } else if (token.type == TOKENTYPE::DIV) {
-            eat(TOKENTYPE::DIV);
-            long rhs = factor();
-            if (rhs == 0) {
-                throw("Division by zero");
+// Constructor.  A thread's Stats are made when it first needs them and are
+// then reported along with everyone else's.  If its counters can't be
+// opened it just does without.
+Stats::Stats() : _spent{}, _seen{0}, _inner{0}, _counting{PHASES},
+_counters{}, _members{}, _figures{{}, 0, 0, 0, 0, {}, {}, {}}, _lock{} {
+    for (size_t p = 0; p < COUNTED; p++) {
+        _counters[p] = -1;
+        for (size_t e = 0; e < EVENTS; e++) {
+            _members[p][e] = -1;
+        }
+        if (!_counted) {
+            continue;
+        }
+        for (size_t e = 0; e < EVENTS; e++) {
+            _members[p][e] = open_counter(e, _counters[p]);
+            if (_members[p][e] < 0) {
+                break;
+            }
+            if (e == 0) {
+                _counters[p] = _members[p][e];
             }
-            result /= rhs;
         }
     }
 
-    return result;
+    lock_guard<mutex> guard(_all_lock);
+    _all.push_back(this);
 }
 
-int main() {
-    string text;
-    while(cin) {
-        cout << "calc> ";
-        getline(cin, text);
+// Destructor.  What a thread found out outlives it.
+Stats::~Stats() {
+    {
+        lock_guard<mutex> guard(_all_lock);
+        _all.erase(find(_all.begin(), _all.end(), this));
+        collect();
+        _retired.merge(_figures);
+    }
 
-        try {
-            Lexer lexer(text);
-            Interpreter interpreter(lexer);
-            long result = interpreter.expression();
-            cout << result << endl;
+    for (size_t p = 0; p < COUNTED; p++) {
+        for (size_t e = 0; e < EVENTS; e++) {
+            if (_members[p][e] >= 0) {
+                ::close(_members[p][e]);
+            }
         }
-        catch(const char* error) {
-            cerr << error << endl;
-            break;
+    }
+}
+
+// Open a counter for event on this thread, in the group led by group, or as
+// the leader of a new group if that is -1.  A leader starts off disabled and
+// the rest follow it.
+int Stats::open_counter(size_t event, int group) {
+    static const pair<uint32_t, uint64_t> EVENT[EVENTS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+            PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }  // LLC
+    };
+    perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = EVENT[event].first;
+    attr.config = EVENT[event].second;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group,
+        PERF_FLAG_FD_CLOEXEC));
+}
+
+// Switch the counters for phase on or off.
+void Stats::count(PHASE phase, bool on) {
+    if (phase < COUNTED && _counters[phase] >= 0) {
+        ioctl(_counters[phase], on ? PERF_EVENT_IOC_ENABLE :
+            PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    if (on) {
+        _counting = phase;
+    }
+}
+
+// Read the counters into the figures.  They are running totals so they
+// replace what was there.  If there were more counters than the hardware
+// could count at once they took turns and the totals are scaled up.
+void Stats::collect() {
+    for (size_t p = 0; p < COUNTED; p++) {
+        uint64_t values[3 + EVENTS];
+        if (_counters[p] < 0 ||
+        read(_counters[p], values, sizeof(values)) < 0) {
+            continue;
         }
+        double scale = values[2] ? 1.0 * values[1] / values[2] : 0.0;
+        for (size_t e = 0; e < EVENTS && e < values[0]; e++) {
+            _figures.events[p][e] = static_cast<uint64_t>(values[3 + e] *
+                scale);
+        }
+    }
+}
+
+const char* Stats::name(PHASE phase) {
+    static const char* names[] = { "lex", "parse", "eval", "output", "line" };
+    return names[phase];
+}
+
+// Count an allocation of size bytes.  With --assert-no-alloc, once a thread
+// has warmed up there should be none while lexing, parsing or evaluating.
+// The message is written without anything which might allocate.
+void Stats::allocated(size_t size) {
+    _allocations[_where]++;
+    _allocated[_where] += size;
+
+    if (assert_no_alloc && _lines >= WARMUP &&
+    (_where == LEX || _where == PARSE || _where == EVAL)) {
+        const char* phase = name(_where);
+        const char* message = " allocated after warming up\n";
+        ssize_t written = write(STDERR_FILENO, phase, strlen(phase));
+        written = write(STDERR_FILENO, message, strlen(message));
+        (void)written;
+        abort();
     }
+}
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+// Count a token.  Every INTEGER and operator makes a node of the syntax tree
+// too.
+void Stats::token(TOKENTYPE type) {
+    _tokens++;
+    if (type != TOKENTYPE::LPAREN && type != TOKENTYPE::RPAREN &&
+    type != TOKENTYPE::SEMI && type != TOKENTYPE::ENDOFFILE) {
+        _nodes++;
+    }
+}
+
+// Start gathering stats, with hardware counters if counters is set and they
+// can be had.  How long a tick is and how many of them it takes just to read
+// the timer are measured first so they can be allowed for.
+void Stats::start(bool counters) {
+    if (counters) {
+        int fd = open_counter(0, -1);
+        if (fd < 0) {
+            cerr << "Can't use performance counters: " << strerror(errno)
+                << endl;
+        } else {
+            ::close(fd);
+            _counted = true;
+        }
+    }
+
+    uint64_t overhead = UINT64_MAX;
+    for (size_t i = 0; i < 1000; i++) {
+        uint64_t t = ticks();
+        overhead = min(overhead, ticks() - t);
+    }
+    _overhead = overhead;
+
+    auto begin = chrono::steady_clock::now();
+    uint64_t t = ticks();
+    this_thread::sleep_for(chrono::milliseconds(20));
+    uint64_t elapsed = ticks() - t;
+    _ns_per_tick = chrono::duration<double, nano>(
+        chrono::steady_clock::now() - begin).count() /
+        max<uint64_t>(elapsed, 1);
+
+    report_on_signal();
+    enabled = true;
+}
+
+// Log lines which take more than threshold nanoseconds, not counting
+// writing out their results, to fd.  Only the first rate in any one second
+// are logged; the next entry says how many were dropped.
+void Stats::log_slow(uint64_t threshold, int fd, size_t rate) {
+    _slow_ns = threshold;
+    _slow_fd = fd;
+    _slow_rate = rate;
+}
+
+// Make the slow log's entry for the line just finished, or nothing if too
+// many have been logged this second.  It is called with _lock held, so the
+// entry is written out by the caller afterwards.
+string Stats::slow(const string* text) {
+    uint64_t second = static_cast<uint64_t>(chrono::duration_cast<
+        chrono::seconds>(chrono::steady_clock::now().time_since_epoch())
+        .count());
+    uint64_t current = _slow_second.load(memory_order_relaxed);
+    if (current != second &&
+    _slow_second.compare_exchange_strong(current, second)) {
+        _slow_logged.store(0, memory_order_relaxed);
+    }
+    if (_slow_logged.fetch_add(1, memory_order_relaxed) >= _slow_rate) {
+        _slow_dropped.fetch_add(1, memory_order_relaxed);
+        return string();
+    }
+
+    size_t depth = 0;
+    if (text) {
+        size_t open = 0;
+        for (char c : *text) {
+            if (c == '(') {
+                depth = max(depth, ++open);
+            } else if (c == ')' && open) {
+                open--;
+            }
+        }
+    }
+
+    ostringstream out;
+    out << "slow: " << static_cast<uint64_t>((_spent[LINE] - _spent[OUTPUT]) *
+        _ns_per_tick) << "ns,";
+    for (size_t i = 0; i < LINE; i++) {
+        out << ' ' << name(static_cast<PHASE>(i)) << ' '
+            << static_cast<uint64_t>(_spent[i] * _ns_per_tick) << "ns";
+    }
+    out << ", " << _tokens << " tokens, depth " << depth;
+    size_t dropped = _slow_dropped.exchange(0, memory_order_relaxed);
+    if (dropped) {
+        out << ", " << dropped << " dropped";
+    }
+    if (text) {
+        out << ": ";
+        for (size_t i = 0; i < min(text->length(), SLOWTEXT); i++) {
+            char c = (*text)[i];
+            out << (isprint(static_cast<unsigned char>(c)) ? c : '?');
+        }
+        if (text->length() > SLOWTEXT) {
+            out << "...";
+        }
+    }
+    out << '\n';
+    return out.str();
+}
+
+// Write an entry to the slow log.
+void Stats::log(const string& entry) {
+    const char* data = entry.data();
+    size_t length = entry.length();
+    while (length) {
+        ssize_t n = write(_slow_fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+}
+
+// This thread's Stats.
+Stats& Stats::local() {
+    static thread_local Stats stats;
+    return stats;
+}
+
+// Add the figures from other to these.
+void Stats::Figures::merge(const Figures& other) {
+    for (size_t i = 0; i < PHASES; i++) {
+        histograms[i].merge(other.histograms[i]);
+    }
+    lines += other.lines;
+    sampled += other.sampled;
+    tokens += other.tokens;
+    nodes += other.nodes;
+    for (size_t p = 0; p < COUNTED; p++) {
+        for (size_t e = 0; e < EVENTS; e++) {
+            events[p][e] += other.events[p][e];
+        }
+    }
+    for (size_t p = 0; p < PHASES; p++) {
+        allocations[p] += other.allocations[p];
+        allocated[p] += other.allocated[p];
+    }
+}
+
+// Print the percentiles of each phase and the counts, for every thread put
+// together.
+void Stats::dump(ostream& out) {
+    unique_ptr<Figures> total(new Figures{{}, 0, 0, 0, 0, {}, {}, {}});
+    {
+        lock_guard<mutex> guard(_all_lock);
+        for (auto stats : _all) {
+            lock_guard<mutex> stats_guard(stats->_lock);
+            stats->collect();
+            total->merge(stats->_figures);
+        }
+        total->merge(_retired);
+    }
+
+    out << "stats: " << total->lines << " lines, " << total->tokens
+        << " tokens, " << total->nodes << " nodes, timer "
+        << fixed << setprecision(3) << _ns_per_tick << "ns/tick, "
+        << _overhead << " ticks overhead" << endl;
+    for (size_t i = 0; i < PHASES; i++) {
+        const Histogram& h = total->histograms[i];
+        if (h.count() == 0) {
+            continue;
+        }
+        out << "stats: " << name(static_cast<PHASE>(i))
+            << (i == LINE ? "" : " (sampled)") << " per line p50 "
+            << h.percentile(0.5) << "ns, p90 " << h.percentile(0.9)
+            << "ns, p99 " << h.percentile(0.99) << "ns, p999 "
+            << h.percentile(0.999) << "ns" << endl;
+    }
+
+    if (COUNTING_ALLOCATIONS && total->lines) {
+        double lines = static_cast<double>(total->lines);
+        out << "allocations: per line";
+        for (size_t p = 0; p < PHASES; p++) {
+            out << (p ? ", " : " ") << setprecision(2)
+                << total->allocations[p] / lines << " ("
+                << setprecision(0) << total->allocated[p] / lines
+                << " bytes) " << (p == LINE ? "elsewhere" :
+                name(static_cast<PHASE>(p)));
+        }
+        out << endl;
+    }
+
+    if (!_counted || total->sampled == 0) {
+        return;
+    }
+    for (size_t p = 0; p < COUNTED; p++) {
+        if (total->histograms[p].count() == 0) {
+            continue;
+        }
+        const uint64_t* events = total->events[p];
+        double lines = static_cast<double>(total->sampled);
+        out << "counters: " << name(static_cast<PHASE>(p)) << " per line "
+            << setprecision(0) << events[0] / lines << " cycles, "
+            << events[1] / lines << " instructions (" << setprecision(2)
+            << (events[0] ? 1.0 * events[1] / events[0] : 0.0) << " IPC), "
+            << events[2] / lines << " branch-misses, " << events[3] / lines
+            << " L1D misses, " << events[4] / lines << " LLC misses" << endl;
+    }
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Count every allocation.  The array forms and the rest come back to these.
+// They aren't inlined so the compiler doesn't see free() given what malloc()
+// returned by way of new and take it for a mistake.
+__attribute__((noinline)) void* operator new(size_t size) {
+    Stats::allocated(size);
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#endif
+
+// Write out whatever --stats and --trace have gathered so far.  A report
+// asked for by SIGUSR1 may come at the same time as the one at the end.
+void report() {
+    static mutex lock;
+    lock_guard<mutex> guard(lock);
+    if (Stats::reporting) {
+        Stats::dump(cerr);
+    }
+    if (Trace::enabled) {
+        Trace::write();
+    }
+}
+
+// Anything Interpreter or Parser can get tokens from.  start() says where
+// the last token came from and rewind() goes back there so it, and those
+// after it, are handed out again.
+class TokenSource {
+public:
+    virtual ~TokenSource();
+    virtual Token   get_next_token() = 0;
+    virtual size_t  start() const = 0;
+    virtual void    rewind(size_t start) = 0;
+};
+
+TokenSource::~TokenSource() {
+}
+
+// Hands out tokens which have already been lexed, perhaps by someone else
+// entirely, followed by ENDOFFILE.
+class TokenStream : public TokenSource {
+public:
+    TokenStream(const Token* tokens, size_t count);
+    Token   get_next_token() override;
+    size_t  start() const override;
+    void    rewind(size_t start) override;
+private:
+    const Token*    _tokens;
+    size_t          _count;
+    size_t          _pos;
+    size_t          _start;     // index of the last token handed out
+};
+
+// Constructor
+TokenStream::TokenStream(const Token* tokens, size_t count) : _tokens{tokens},
+_count{count}, _pos{0}, _start{0} {
+}
+
+Token TokenStream::get_next_token() {
+    _start = _pos;
+    if (_pos < _count) {
+        return _tokens[_pos++];
+    }
+
+    return Token(TOKENTYPE::ENDOFFILE, '\0');
+}
+
+size_t TokenStream::start() const {
+    return _start;
+}
+
+void TokenStream::rewind(size_t start) {
+    _pos = _start = start;
+}
+
+class Lexer : public TokenSource {
+public:
+    Lexer(string& text, size_t pos = 0);
+    Token   get_next_token() override;
+    long    integer();
+    size_t  start() const override;
+    void    rewind(size_t start) override;
+    size_t  position() const;
+
+    static bool trace;      // log each token to cerr as it is emitted
+private:
+    string& _text;          // client string input, e.g. "3+5"
+    size_t  _pos;           // an index into _text
+    size_t  _start;         // where in _text the last token started
+    char    _current_char;  // the character at _text[_pos]
+
+    Token lex();
+    void  advance();
+    void  skip_whitespace();
+};
+
+bool Lexer::trace = true;
+
+// Constructor.  Lexing can start part way through the text.
+Lexer::Lexer(string& text, size_t pos) : _text{text}, _pos{pos},
+_start{pos}, _current_char{pos < text.length() ? _text[_pos] : '\0'} {
+}
+
+// Lexical analyzer (also known as scanner or tokenizer)
+//
+// This method is responsible for breaking a sentence apart into tokens. One
+// token at a time.
+//
+Token Lexer::get_next_token() {
+    if (!Stats::enabled && !Trace::enabled && !COUNTING_ALLOCATIONS) {
+        Token token = lex();
+        PROBE2(token, static_cast<int>(token.type), token.value);
+        return token;
+    }
+
+    Stats::Timer timer(Stats::LEX);
+    Token token = lex();
+    PROBE2(token, static_cast<int>(token.type), token.value);
+    Stats::token(token.type);
+    return token;
+}
+
+// Find the next token in the text.
+Token Lexer::lex() {
+
+    while (_current_char != '\0') {
+        _start = _pos;
+
+        if (isspace(_current_char)) {
+            skip_whitespace();
+            continue;
+        }
+
+        if (isdigit(_current_char)) {
+            Token token(TOKENTYPE::INTEGER, integer());
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == '*') {
+            advance();
+            Token token(TOKENTYPE::MUL, '*');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == '/') {
+            advance();
+            Token token(TOKENTYPE::DIV, '/');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == '+') {
+            advance();
+            Token token(TOKENTYPE::PLUS, '+');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == '-') {
+            advance();
+            Token token(TOKENTYPE::MINUS, '-');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == '(') {
+            advance();
+            Token token(TOKENTYPE::LPAREN, '(');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == ')') {
+            advance();
+            Token token(TOKENTYPE::RPAREN, ')');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        if (_current_char == ';') {
+            advance();
+            Token token(TOKENTYPE::SEMI, ';');
+            if (trace) {
+                cerr << token << endl;
+            }
+            return token;
+        }
+
+        // Step over the offending character so that lexing can carry on
+        // with the next expression.
+        char got[] = {_current_char, '\0'};
+        advance();
+        error("Error parsing input. Got: ", got);
+    }
+
+    _start = _pos;
+    Token token(TOKENTYPE::ENDOFFILE, '\0');
+    if (trace) {
+        cerr << token << endl;
+    }
+    return token;
+}
+
+// Return a (multidigit) integer consumed from the input.  One too large for
+// a long is consumed all the same and then reported as an error.
+long Lexer::integer() {
+    long result = 0;
+    bool overflow = false;
+
+    while (_current_char != '\0' && isdigit(_current_char)) {
+        long digit = _current_char - '0';
+        if (result > (LONG_MAX - digit) / 10) {
+            overflow = true;
+        } else {
+            result = result * 10 + digit;
+        }
+        advance();
+    }
+
+    if (overflow) {
+        error("Integer too large");
+    }
+    return result;
+}
+
+// Where the last token returned by get_next_token() started.
+size_t Lexer::start() const {
+    return _start;
+}
+
+// Go back to start in the text.
+void Lexer::rewind(size_t start) {
+    _pos = _start = start;
+    _current_char = _pos < _text.length() ? _text[_pos] : '\0';
+}
+
+// Where the next token will be looked for.
+size_t Lexer::position() const {
+    return _pos;
+}
+
+// Advance the '_pos' pointer and set the '_current_char' variable.
+void Lexer::advance() {
+    _pos++;
+    if (_pos > _text.length() - 1) {
+        _current_char = '\0';   // Indicates end of input
+    } else {
+        _current_char = _text[_pos];
+    }
+}
+
+// Skip leading white space.
+void Lexer::skip_whitespace() {
+    while (_current_char != '\0' && isspace(_current_char)) {
+        advance();
+    }
+}
+
+// Apply a binary operator to two values.  Arithmetic wraps around like a
+// two's complement machine would rather than being undefined on overflow, so
+// the result does not depend on the order operands are combined in as long
+// as the operator allows it.
+long apply(TOKENTYPE op, long lhs, long rhs) {
+    unsigned long a = static_cast<unsigned long>(lhs);
+    unsigned long b = static_cast<unsigned long>(rhs);
+
+    switch(op) {
+        case TOKENTYPE::PLUS:
+            return static_cast<long>(a + b);
+        case TOKENTYPE::MINUS:
+            return static_cast<long>(a - b);
+        case TOKENTYPE::MUL:
+            return static_cast<long>(a * b);
+        case TOKENTYPE::DIV:
+            if (rhs == 0) {
+                PROBE1(division__by__zero, lhs);
+                throw("Division by zero");
+            }
+            if (rhs == -1) {
+                return static_cast<long>(0 - a);  // LONG_MIN / -1 wraps
+            }
+            return lhs / rhs;
+        default:
+            error("Not an operator");
+    }
+}
+
+class Interpreter {
+public:
+    Interpreter(TokenSource& lexer);
+    bool next();
+    long expression();
+private:
+    TokenSource&    _lexer;
+    Token   _current_token; // current token instance
+    const char*     _error; // the lexer failed at the start of an expression
+
+    void  eat(TOKENTYPE token_type);
+    long  factor();
+    long  term();
+};
+
+// Constructor.  It starts as if just before a SEMI; next() has to be
+// called to get to the first expression.
+Interpreter::Interpreter(TokenSource& lexer) : _lexer{lexer},
+_current_token{TOKENTYPE::SEMI, ';'}, _error{nullptr} {
+}
+
+// Move on to the next of a list of expressions separated by SEMI, skipping
+// whatever is left of the current one, and return whether there is one.  A
+// list may end with a SEMI.  If the lexer can't make sense of the start of
+// the next expression, the error is raised by expression() instead.
+bool Interpreter::next() {
+    while (_error || (_current_token.type != TOKENTYPE::SEMI &&
+    _current_token.type != TOKENTYPE::ENDOFFILE)) {
+        _error = nullptr;
+        try {
+            _current_token = _lexer.get_next_token();
+        }
+        catch(const char*) {
+            _current_token = Token(TOKENTYPE::INTEGER, 0);  // keep skipping
+        }
+    }
+
+    if (_current_token.type == TOKENTYPE::ENDOFFILE) {
+        return false;
+    }
+
+    try {
+        _current_token = _lexer.get_next_token();
+    }
+    catch(const char* error) {
+        _error = error;
+        _current_token = Token(TOKENTYPE::ENDOFFILE, '\0');
+        return true;
+    }
+
+    return _current_token.type != TOKENTYPE::ENDOFFILE;
+}
+
+// Arithmetic expression parser / interpreter.
+// expr    : term ((PLUS | MINUS) term)*
+// term    : factor ((MUL | DIV) factor)*
+// factor  : INTEGER | LPAREN expr RPAREN
+long Interpreter::expression() {
+    Trace::Span span("expression", true);
+    long result = term();
+
+    while (_current_token.type == TOKENTYPE::PLUS ||
+    _current_token.type == TOKENTYPE::MINUS) {
+        Token token = _current_token;
+        if (token.type == TOKENTYPE::PLUS) {
+            eat(TOKENTYPE::PLUS);
+            result = apply(TOKENTYPE::PLUS, result, term());
+        } else if (token.type == TOKENTYPE::MINUS) {
+            eat(TOKENTYPE::MINUS);
+            result = apply(TOKENTYPE::MINUS, result, term());
+        }
+    }
+
+    return result;
+}
+
+// compare the current token type with the passed token type and if they match
+// then "eat" the current token and assign the next token to _current_token,
+// otherwise raise an exception.
+void Interpreter::eat(TOKENTYPE token_type) {
+    if (_current_token.type == token_type) {
+        _current_token = _lexer.get_next_token();
+    } else {
+        PROBE2(eat__mismatch, static_cast<int>(token_type),
+            static_cast<int>(_current_token.type));
+        error("Error parsing input. Wanted: ", name(token_type));
+    }
+}
+
+// factor : INTEGER | LPAREN expr RPAREN
+long Interpreter::factor() {
+    Trace::Span span("factor", true);
+    Token token = _current_token;
+    
+    if (token.type == TOKENTYPE::INTEGER) {
+        eat(TOKENTYPE::INTEGER);
+        return token.value;
+    } else if (token.type == TOKENTYPE::LPAREN) {
+        eat(TOKENTYPE::LPAREN);
+        long result = expression();
+        eat(TOKENTYPE::RPAREN);
+        return result;
+    } else if (_error) {
+        error(_error);
+    } else {
+        error("Error parsing input. Wanted: Integer or (");
+    }
+}
+
+// term : factor ((MUL | DIV) factor)*
+long Interpreter::term() {
+    Trace::Span span("term", true);
+    long result = factor();
+                                                                      
+    while (_current_token.type == TOKENTYPE::MUL
+    || _current_token.type == TOKENTYPE::DIV) {
+        Token token = _current_token;
+        if (token.type == TOKENTYPE::MUL) {
+            eat(TOKENTYPE::MUL);
+            result = apply(TOKENTYPE::MUL, result, factor());
+        } else if (token.type == TOKENTYPE::DIV) {
+            eat(TOKENTYPE::DIV);
+            result = apply(TOKENTYPE::DIV, result, factor());
+        }
+    }
+
+    return result;
+}
+
+// Scramble the bits of x.  This is the finalizer of SplitMix64.
+uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Structural hash of a subtree.  It is made of two independent 64-bit hashes
+// so that two different subtrees sharing one by accident is vanishingly
+// unlikely.
+struct Key {
+    uint64_t    a;
+    uint64_t    b;
+
+    Key     add(uint64_t x) const;
+    bool    operator==(const Key& other) const;
+};
+
+// Fold x into the hash.
+Key Key::add(uint64_t x) const {
+    return Key{mix(a ^ (x + 0x9e3779b97f4a7c15ULL)),
+        mix((b + x) * 0xd6e8feb86659fd93ULL + 1)};
+}
+
+bool Key::operator==(const Key& other) const {
+    return a == other.a && b == other.b;
+}
+
+// Values of parenthesized subexpressions seen so far in this session, shared
+// by every line and every thread.  The table has a fixed number of slots and
+// each key can only go in one of them, so a newer entry simply replaces
+// whatever was there before.  Every lookup and insertion takes a lock, even
+// when only one thread is reading input, because WorkStealingPool's threads
+// look up the small groups of a long line too; uncontended that costs about
+// 40ns a call.
+class Memo {
+public:
+    Memo(size_t size);
+    bool    find(const Key& key, long& value);
+    void    insert(const Key& key, long value);
+    void    dump(ostream& out) const;
+    size_t  hits() const;
+    size_t  lookups() const;
+
+    static const size_t MAXSLOTS = 1 << 24; // half a gigabyte of entries
+private:
+    static const size_t STRIPES = 64;   // slots share this many locks
+
+    struct Entry {
+        Key     key;
+        long    value;
+        bool    used;
+    };
+
+    vector<Entry>   _entries;
+    size_t          _mask;
+    mutex           _locks[STRIPES];
+    atomic<size_t>  _hits;
+    atomic<size_t>  _misses;
+    atomic<size_t>  _insertions;
+    atomic<size_t>  _evictions;
+};
+
+// Constructor.  The number of slots is rounded up to a power of two.
+Memo::Memo(size_t size) : _entries{}, _mask{0}, _locks{}, _hits{0},
+_misses{0}, _insertions{0}, _evictions{0} {
+    size_t slots = 1;
+    while (slots < size) {
+        slots *= 2;
+    }
+    _entries.resize(slots, Entry{Key{0, 0}, 0, false});
+    _mask = slots - 1;
+}
+
+// Look up the value for key.
+bool Memo::find(const Key& key, long& value) {
+    size_t slot = key.a & _mask;
+    lock_guard<mutex> guard(_locks[slot % STRIPES]);
+    const Entry& entry = _entries[slot];
+
+    if (entry.used && entry.key == key) {
+        value = entry.value;
+        _hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    _misses.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+// Remember the value for key.
+void Memo::insert(const Key& key, long value) {
+    size_t slot = key.a & _mask;
+    lock_guard<mutex> guard(_locks[slot % STRIPES]);
+    Entry& entry = _entries[slot];
+
+    if (entry.used && !(entry.key == key)) {
+        _evictions.fetch_add(1, memory_order_relaxed);
+    }
+    entry = Entry{key, value, true};
+    _insertions.fetch_add(1, memory_order_relaxed);
+}
+
+// How many lookups found what they were after.
+size_t Memo::hits() const {
+    return _hits.load(memory_order_relaxed);
+}
+
+// How many lookups there have been.
+size_t Memo::lookups() const {
+    return hits() + _misses.load(memory_order_relaxed);
+}
+
+// Print how well the table is doing.
+void Memo::dump(ostream& out) const {
+    size_t hits = _hits.load(memory_order_relaxed);
+    size_t lookups = hits + _misses.load(memory_order_relaxed);
+
+    out << "memo: " << _entries.size() << " slots, " << lookups
+        << " lookups, " << hits << " hits ("
+        << fixed << setprecision(1)
+        << (lookups ? 100.0 * hits / lookups : 0.0) << "%), "
+        << _insertions.load(memory_order_relaxed) << " insertions, "
+        << _evictions.load(memory_order_relaxed) << " evictions" << endl;
+}
+
+// A node of the abstract syntax tree.  A node is either an INTEGER or a chain
+// of operands joined by PLUS and MINUS (an expression) or by MUL and DIV (a
+// term.)  Chains are kept flat rather than as nested binary nodes so that a
+// long run like 1+2+3+... doesn't become a tree as deep as it is long.
+struct AST {
+    TOKENTYPE   type;   // INTEGER, PLUS for an expression or MUL for a term
+    bool        group;  // whether it was written in parentheses
+    long        value;  // value of an INTEGER
+    size_t      first;  // index of the first operand of a chain
+    size_t      count;  // number of operands in a chain
+    size_t      size;   // number of nodes in this subtree
+};
+
+// An operand of a chain and the operator which joins it to what came before.
+// The first operand of a chain gets the chain's own type.
+struct Operand {
+    TOKENTYPE   op;
+    size_t      node;
+};
+
+// The nodes of an expression.  Nodes refer to each other by index so a whole
+// tree lives in a few vectors.
+class Tree {
+public:
+    Tree();
+    void            clear();
+    size_t          integer(long value);
+    size_t          chain(TOKENTYPE type, const Operand* operands,
+                        size_t count);
+    void            group(size_t n);
+    const AST&      node(size_t n) const;
+    const Key&      key(size_t n) const;
+    const Operand&  operand(size_t i) const;
+    size_t          root() const;
+    size_t          size() const;
+    size_t          operands() const;
+    long            evaluate(size_t n) const;
+
+    static Memo*    memo;   // if set, values of groups are looked up here
+private:
+    vector<AST>     _nodes;
+    vector<Operand> _operands;
+    vector<Key>     _keys;  // structural hash of each node, only worked
+                            // out while there is a memo to look it up in
+};
+
+Memo* Tree::memo = nullptr;
+
+// Constructor
+Tree::Tree() : _nodes{}, _operands{}, _keys{} {
+}
+
+// Remove all nodes so the tree can be reused.
+void Tree::clear() {
+    _nodes.clear();
+    _operands.clear();
+    _keys.clear();
+}
+
+// Add an INTEGER node.
+size_t Tree::integer(long value) {
+    _nodes.push_back(AST{TOKENTYPE::INTEGER, false, value, 0, 0, 1});
+    if (memo) {
+        _keys.push_back(Key{0, 0}.add(
+            static_cast<uint64_t>(TOKENTYPE::INTEGER))
+            .add(static_cast<uint64_t>(value)));
+    }
+    return _nodes.size() - 1;
+}
+
+// Add a chain node made of count operands.
+size_t Tree::chain(TOKENTYPE type, const Operand* operands, size_t count) {
+    size_t size = 1;
+    for (size_t i = 0; i < count; i++) {
+        size += _nodes[operands[i].node].size;
+    }
+    if (memo) {
+        Key key = Key{0, 0}.add(static_cast<uint64_t>(type));
+        for (size_t i = 0; i < count; i++) {
+            const Key& operand = _keys[operands[i].node];
+            key = key.add(static_cast<uint64_t>(operands[i].op))
+                .add(operand.a).add(operand.b);
+        }
+        _keys.push_back(key);
+    }
+    _nodes.push_back(AST{type, false, 0, _operands.size(), count, size});
+    _operands.insert(_operands.end(), operands, operands + count);
+    return _nodes.size() - 1;
+}
+
+// Mark node n as having been written in parentheses.
+void Tree::group(size_t n) {
+    _nodes[n].group = true;
+}
+
+const AST& Tree::node(size_t n) const {
+    return _nodes[n];
+}
+
+const Key& Tree::key(size_t n) const {
+    return _keys[n];
+}
+
+const Operand& Tree::operand(size_t i) const {
+    return _operands[i];
+}
+
+// The root is the last node added as children are always added before their
+// parents.
+size_t Tree::root() const {
+    return _nodes.size() - 1;
+}
+
+// The number of nodes.
+size_t Tree::size() const {
+    return _nodes.size();
+}
+
+// The number of operands in all the chains.
+size_t Tree::operands() const {
+    return _operands.size();
+}
+
+// Evaluate the subtree starting at node n.
+long Tree::evaluate(size_t n) const {
+    const AST& node = _nodes[n];
+
+    if (node.type == TOKENTYPE::INTEGER) {
+        return node.value;
+    }
+
+    long result;
+    bool memoize = memo && node.group;
+    if (memoize && memo->find(_keys[n], result)) {
+        return result;
+    }
+
+    result = evaluate(_operands[node.first].node);
+    for (size_t i = node.first + 1; i < node.first + node.count; i++) {
+        result = apply(_operands[i].op, result, evaluate(_operands[i].node));
+    }
+
+    if (memoize) {
+        memo->insert(_keys[n], result);
+    }
+
+    return result;
+}
+
+// Builds a Tree from the tokens in a Lexer.  The grammar is the same as the
+// one Interpreter uses.
+class Parser {
+public:
+    Parser(TokenSource& lexer, Tree& tree);
+    bool next();
+    size_t parse();
+    void skip();
+private:
+    TokenSource&    _lexer;
+    Tree&           _tree;
+    Token           _current_token;     // current token instance
+    const char*     _error;             // as in Interpreter
+    vector<Operand>& _stack;            // operands of the chains being built
+
+    void    eat(TOKENTYPE token_type);
+    size_t  chain(TOKENTYPE type, size_t mark);
+    size_t  expression();
+    size_t  factor();
+    size_t  term();
+
+    static vector<Operand>& stack();
+};
+
+// Constructor.  As with Interpreter, next() gets to the first expression.
+Parser::Parser(TokenSource& lexer, Tree& tree) : _lexer{lexer}, _tree{tree},
+_current_token{TOKENTYPE::SEMI, ';'}, _error{nullptr}, _stack{stack()} {
+}
+
+// The operand stack.  There is one per thread, kept from one Parser to the
+// next, so that it doesn't have to grow again for every line.
+vector<Operand>& Parser::stack() {
+    static thread_local vector<Operand> stack;
+    return stack;
+}
+
+// Move on to the next of a list of expressions, just as Interpreter does.
+bool Parser::next() {
+    while (_error || (_current_token.type != TOKENTYPE::SEMI &&
+    _current_token.type != TOKENTYPE::ENDOFFILE)) {
+        _error = nullptr;
+        try {
+            _current_token = _lexer.get_next_token();
+        }
+        catch(const char*) {
+            _current_token = Token(TOKENTYPE::INTEGER, 0);
+        }
+    }
+
+    if (_current_token.type == TOKENTYPE::ENDOFFILE) {
+        return false;
+    }
+
+    try {
+        _current_token = _lexer.get_next_token();
+    }
+    catch(const char* error) {
+        _error = error;
+        _current_token = Token(TOKENTYPE::ENDOFFILE, '\0');
+        return true;
+    }
+
+    return _current_token.type != TOKENTYPE::ENDOFFILE;
+}
+
+// Parse the current expression and return the root of its tree.
+size_t Parser::parse() {
+    _stack.clear();
+    return expression();
+}
+
+// Give up on the current expression after the lexer has been rewound to its
+// start, so that next() skips all of it again.
+void Parser::skip() {
+    _error = nullptr;
+    _current_token = Token(TOKENTYPE::INTEGER, 0);
+}
+
+// compare the current token type with the passed token type and if they match
+// then "eat" the current token and assign the next token to _current_token,
+// otherwise raise an exception.
+void Parser::eat(TOKENTYPE token_type) {
+    if (_current_token.type == token_type) {
+        _current_token = _lexer.get_next_token();
+    } else {
+        PROBE2(eat__mismatch, static_cast<int>(token_type),
+            static_cast<int>(_current_token.type));
+        error("Error parsing input. Wanted: ", name(token_type));
+    }
+}
+
+// Turn the operands pushed on the stack since mark into a chain node.  A
+// chain of one is just that one operand.
+size_t Parser::chain(TOKENTYPE type, size_t mark) {
+    size_t node = _stack[mark].node;
+
+    if (_stack.size() - mark > 1) {
+        node = _tree.chain(type, &_stack[mark], _stack.size() - mark);
+    }
+    _stack.resize(mark);
+
+    return node;
+}
+
+// expr : term ((PLUS | MINUS) term)*
+size_t Parser::expression() {
+    Trace::Span span("expression", true);
+    size_t mark = _stack.size();
+    _stack.push_back(Operand{TOKENTYPE::PLUS, term()});
+
+    while (_current_token.type == TOKENTYPE::PLUS ||
+    _current_token.type == TOKENTYPE::MINUS) {
+        TOKENTYPE op = _current_token.type;
+        eat(op);
+        _stack.push_back(Operand{op, term()});
+    }
+
+    return chain(TOKENTYPE::PLUS, mark);
+}
+
+// factor : INTEGER | LPAREN expr RPAREN
+size_t Parser::factor() {
+    Trace::Span span("factor", true);
+    Token token = _current_token;
+
+    if (token.type == TOKENTYPE::INTEGER) {
+        eat(TOKENTYPE::INTEGER);
+        return _tree.integer(token.value);
+    } else if (token.type == TOKENTYPE::LPAREN) {
+        eat(TOKENTYPE::LPAREN);
+        size_t node = expression();
+        eat(TOKENTYPE::RPAREN);
+        _tree.group(node);
+        return node;
+    } else if (_error) {
+        error(_error);
+    } else {
+        error("Error parsing input. Wanted: Integer or (");
+    }
+}
+
+// term : factor ((MUL | DIV) factor)*
+size_t Parser::term() {
+    Trace::Span span("term", true);
+    size_t mark = _stack.size();
+    _stack.push_back(Operand{TOKENTYPE::MUL, factor()});
+
+    while (_current_token.type == TOKENTYPE::MUL ||
+    _current_token.type == TOKENTYPE::DIV) {
+        TOKENTYPE op = _current_token.type;
+        eat(op);
+        _stack.push_back(Operand{op, factor()});
+    }
+
+    return chain(TOKENTYPE::MUL, mark);
+}
+
+// Chase-Lev work stealing deque.  The thread which owns it pushes and pops
+// items at the bottom while other threads steal them from the top.  This
+// follows "Correct and Efficient Work-Stealing for Weak Memory Models" by Lê,
+// Pop, Cohen and Zappa Nardelli.
+template<typename T>
+class ChaseLevDeque {
+public:
+    ChaseLevDeque();
+    void    push(T item);
+    bool    pop(T& item);
+    bool    steal(T& item);
+private:
+    // A circular array of items.
+    struct Array {
+        Array(size_t size);
+        T       get(int64_t i) const;
+        void    put(int64_t i, T item);
+
+        size_t                  size;
+        unique_ptr<atomic<T>[]> items;
+    };
+
+    atomic<int64_t>             _top;
+    char                        _pad1[64];  // keep _top and _bottom on
+    atomic<int64_t>             _bottom;    // different cache lines
+    char                        _pad2[64];
+    atomic<Array*>              _array;
+    vector<unique_ptr<Array>>   _arrays;    // every array ever used.  Old
+                                            // ones may still be read by
+                                            // thieves so they are kept.
+};
+
+template<typename T>
+ChaseLevDeque<T>::Array::Array(size_t size) : size{size},
+items{new atomic<T>[size]} {
+}
+
+template<typename T>
+T ChaseLevDeque<T>::Array::get(int64_t i) const {
+    return items[i & (size - 1)].load(memory_order_relaxed);
+}
+
+template<typename T>
+void ChaseLevDeque<T>::Array::put(int64_t i, T item) {
+    items[i & (size - 1)].store(item, memory_order_relaxed);
+}
+
+// Constructor
+template<typename T>
+ChaseLevDeque<T>::ChaseLevDeque() : _top{0}, _pad1{}, _bottom{0}, _pad2{},
+_array{nullptr}, _arrays{} {
+    _arrays.emplace_back(new Array(64));
+    _array.store(_arrays.back().get(), memory_order_relaxed);
+}
+
+// Push an item onto the bottom.  Only the owner may call this.
+template<typename T>
+void ChaseLevDeque<T>::push(T item) {
+    int64_t b = _bottom.load(memory_order_relaxed);
+    int64_t t = _top.load(memory_order_acquire);
+    Array* a = _array.load(memory_order_relaxed);
+
+    if (b - t > static_cast<int64_t>(a->size) - 1) {
+        Array* bigger = new Array(a->size * 2);
+        for (int64_t i = t; i < b; i++) {
+            bigger->put(i, a->get(i));
+        }
+        _arrays.emplace_back(bigger);
+        _array.store(bigger, memory_order_release);
+        a = bigger;
+    }
+
+    a->put(b, item);
+    atomic_thread_fence(memory_order_release);
+    _bottom.store(b + 1, memory_order_relaxed);
+}
+
+// Pop an item from the bottom.  Only the owner may call this.
+template<typename T>
+bool ChaseLevDeque<T>::pop(T& item) {
+    int64_t b = _bottom.load(memory_order_relaxed) - 1;
+    Array* a = _array.load(memory_order_relaxed);
+    _bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = _top.load(memory_order_relaxed);
+
+    if (t > b) {
+        _bottom.store(b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    item = a->get(b);
+    if (t == b) {
+        // Last item; race any thieves for it.
+        bool won = _top.compare_exchange_strong(t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+        _bottom.store(b + 1, memory_order_relaxed);
+        return won;
+    }
+
+    return true;
+}
+
+// Steal an item from the top.  Any thread may call this.
+template<typename T>
+bool ChaseLevDeque<T>::steal(T& item) {
+    int64_t t = _top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = _bottom.load(memory_order_acquire);
+
+    if (t >= b) {
+        return false;
+    }
+
+    Array* a = _array.load(memory_order_acquire);
+    item = a->get(t);
+    return _top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+        memory_order_relaxed);
+}
+
+// Sum or multiply a block of values.  The independent lanes give the compiler
+// a loop it can vectorize.
+unsigned long reduce_block(TOKENTYPE op, const unsigned long* values,
+size_t count) {
+    const size_t LANES = 4;
+    unsigned long identity = op == TOKENTYPE::MUL ? 1 : 0;
+    unsigned long lanes[LANES] = { identity, identity, identity, identity };
+    size_t i = 0;
+
+    if (op == TOKENTYPE::MUL) {
+        for (; i + LANES <= count; i += LANES) {
+            for (size_t j = 0; j < LANES; j++) {
+                lanes[j] *= values[i + j];
+            }
+        }
+        for (; i < count; i++) {
+            lanes[0] *= values[i];
+        }
+        return lanes[0] * lanes[1] * lanes[2] * lanes[3];
+    }
+
+    for (; i + LANES <= count; i += LANES) {
+        for (size_t j = 0; j < LANES; j++) {
+            lanes[j] += values[i + j];
+        }
+    }
+    for (; i < count; i++) {
+        lanes[0] += values[i];
+    }
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+// Evaluates large trees by splitting their chains into ranges of operands
+// which a pool of threads steal from each other.  Subtrees smaller than
+// CUTOFF nodes are not worth the overhead and are evaluated inline.  A
+// division by zero anywhere cancels all the outstanding work.
+class WorkStealingPool {
+public:
+    WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+    long evaluate(const Tree& tree);
+    size_t threads() const;
+
+    static const size_t CUTOFF = 4096;  // smallest subtree worth a task
+private:
+    static const size_t CHUNK = 512;    // operands reduced by one task
+
+    // Operands lo to hi of the chain at node, to be reduced by whichever
+    // thread gets to them first.
+    struct Task {
+        const Tree*         tree;
+        size_t              node;
+        size_t              lo;
+        size_t              hi;
+        long                result;
+        atomic<size_t>*     pending;    // tasks the spawner is waiting for
+    };
+
+    vector<unique_ptr<ChaseLevDeque<Task*>>>    _deques;
+    vector<thread>                              _threads;
+    mutex                                       _entry; // one caller at a time
+    mutex                                       _lock;
+    condition_variable                          _wake;
+    atomic<bool>                                _active;
+    atomic<bool>                                _cancelled;
+    bool                                        _stop;
+
+    static thread_local size_t                  _self;  // this thread's deque
+
+    long    evaluate(const Tree& tree, size_t n);
+    long    chain(const Tree& tree, size_t n);
+    long    reduce(const Tree& tree, size_t n, size_t lo, size_t hi);
+    long    run_inline(const Tree& tree, size_t n);
+    void    run(Task* task);
+    void    join(atomic<size_t>& pending);
+    bool    steal(Task*& task);
+    void    work(size_t self);
+};
+
+thread_local size_t WorkStealingPool::_self = 0;
+
+// Constructor.  The thread calling evaluate() takes part too so there is one
+// more deque than threads.
+WorkStealingPool::WorkStealingPool(size_t threads) : _deques{}, _threads{},
+_entry{}, _lock{}, _wake{}, _active{false}, _cancelled{false}, _stop{false} {
+    for (size_t i = 0; i <= threads; i++) {
+        _deques.emplace_back(new ChaseLevDeque<Task*>());
+    }
+    for (size_t i = 1; i <= threads; i++) {
+        _threads.emplace_back(&WorkStealingPool::work, this, i);
+    }
+}
+
+// Destructor
+WorkStealingPool::~WorkStealingPool() {
+    {
+        lock_guard<mutex> guard(_lock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& t : _threads) {
+        t.join();
+    }
+}
+
+// Number of threads besides the caller's.
+size_t WorkStealingPool::threads() const {
+    return _threads.size();
+}
+
+// Evaluate a whole tree.  If another thread is already using the pool, the
+// tree is evaluated sequentially instead of waiting.
+long WorkStealingPool::evaluate(const Tree& tree) {
+    unique_lock<mutex> entry(_entry, try_to_lock);
+    if (!entry) {
+        return tree.evaluate(tree.root());
+    }
+
+    _self = 0;
+    _cancelled.store(false, memory_order_relaxed);
+    {
+        lock_guard<mutex> guard(_lock);
+        _active.store(true, memory_order_release);
+    }
+    _wake.notify_all();
+
+    long result = run_inline(tree, tree.root());
+
+    _active.store(false, memory_order_release);
+    if (_cancelled.load(memory_order_acquire)) {
+        throw("Division by zero");
+    }
+
+    return result;
+}
+
+// Evaluate the subtree at node n, spawning tasks for its large operands.
+// Only subtrees smaller than CUTOFF go through Tree::evaluate() and so the
+// memo; larger groups are always evaluated and never remembered.
+long WorkStealingPool::evaluate(const Tree& tree, size_t n) {
+    if (tree.node(n).size < CUTOFF) {
+        return tree.evaluate(n);
+    }
+    return chain(tree, n);
+}
+
+// Evaluate a large chain.  Wrapping addition and multiplication are
+// associative so the operands of an expression, and each run of MUL operands
+// in a term, can be combined in any grouping and still give exactly what
+// folding them from left to right would.  DIV operands break up the runs and
+// are applied in order.
+long WorkStealingPool::chain(const Tree& tree, size_t n) {
+    const AST& node = tree.node(n);
+
+    if (node.type == TOKENTYPE::PLUS) {
+        return reduce(tree, n, 0, node.count);
+    }
+
+    long result = run_inline(tree, tree.operand(node.first).node);
+    size_t i = 1;
+    while (i < node.count && !_cancelled.load(memory_order_relaxed)) {
+        if (tree.operand(node.first + i).op == TOKENTYPE::MUL) {
+            size_t j = i + 1;
+            while (j < node.count &&
+            tree.operand(node.first + j).op == TOKENTYPE::MUL) {
+                j++;
+            }
+            result = apply(TOKENTYPE::MUL, result, reduce(tree, n, i, j));
+            i = j;
+        } else {
+            long rhs = run_inline(tree, tree.operand(node.first + i).node);
+            if (rhs == 0) {
+                _cancelled.store(true, memory_order_release);
+                return 0;
+            }
+            result = apply(TOKENTYPE::DIV, result, rhs);
+            i++;
+        }
+    }
+
+    return result;
+}
+
+// Combine operands lo to hi of the chain at node n.  For an expression this
+// is their sum with MINUS operands negated; for a term it is their product
+// and they must all be MUL.  Ranges longer than a CHUNK, or with CUTOFF nodes
+// or more between them, are split in half and one half is handed out as a
+// task so the chain is reduced as a tree.  The nodes of a subtree are
+// contiguous and end at its root so a range's size is a subtraction.
+long WorkStealingPool::reduce(const Tree& tree, size_t n, size_t lo,
+size_t hi) {
+    const AST& node = tree.node(n);
+    size_t first = tree.operand(node.first + lo).node;
+    size_t last = tree.operand(node.first + hi - 1).node;
+    size_t size = last + tree.node(first).size - first;
+
+    if (hi - lo <= CHUNK && (hi - lo == 1 || size < CUTOFF)) {
+        unsigned long values[CHUNK];
+        for (size_t i = lo; i < hi; i++) {
+            if (_cancelled.load(memory_order_relaxed)) {
+                return 0;
+            }
+            const Operand& operand = tree.operand(node.first + i);
+            const AST& child = tree.node(operand.node);
+            unsigned long value = static_cast<unsigned long>(
+                child.type == TOKENTYPE::INTEGER ? child.value :
+                run_inline(tree, operand.node));
+            values[i - lo] = operand.op == TOKENTYPE::MINUS ? 0 - value : value;
+        }
+        return static_cast<long>(reduce_block(node.type, values, hi - lo));
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    atomic<size_t> pending{1};
+    Task task{&tree, n, lo, mid, 0, &pending};
+    _deques[_self]->push(&task);
+
+    long rhs = reduce(tree, n, mid, hi);
+    join(pending);
+
+    return apply(node.type, task.result, rhs);
+}
+
+// Evaluate a subtree, turning an error into cancellation of everything else.
+long WorkStealingPool::run_inline(const Tree& tree, size_t n) {
+    if (_cancelled.load(memory_order_relaxed)) {
+        return 0;
+    }
+
+    try {
+        return evaluate(tree, n);
+    }
+    catch(const char*) {
+        _cancelled.store(true, memory_order_release);
+        return 0;
+    }
+}
+
+// Run a task and let its spawner know it is done.
+void WorkStealingPool::run(Task* task) {
+    task->result = reduce(*task->tree, task->node, task->lo, task->hi);
+    task->pending->fetch_sub(1, memory_order_release);
+}
+
+// Help out until every task a caller has spawned has finished.  Tasks live on
+// the caller's stack frame so it cannot return any earlier.
+void WorkStealingPool::join(atomic<size_t>& pending) {
+    while (pending.load(memory_order_acquire) != 0) {
+        Task* task;
+        if (_deques[_self]->pop(task) || steal(task)) {
+            run(task);
+        } else {
+            this_thread::yield();
+        }
+    }
+}
+
+// Try to take a task from some other thread.
+bool WorkStealingPool::steal(Task*& task) {
+    size_t n = _deques.size();
+
+    for (size_t i = 1; i < n; i++) {
+        if (_deques[(_self + i) % n]->steal(task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Body of the pool threads.  Sleep until there is a tree being evaluated and
+// then steal work until it is done.
+void WorkStealingPool::work(size_t self) {
+    _self = self;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard(_lock);
+            _wake.wait(guard, [this] {
+                return _stop || _active.load(memory_order_acquire);
+            });
+            if (_stop) {
+                return;
+            }
+        }
+
+        while (_active.load(memory_order_acquire)) {
+            Task* task;
+            if (steal(task)) {
+                run(task);
+            } else {
+                this_thread::yield();
+            }
+        }
+    }
+}
+
+// Keeps the tokens and tree of a line between edits so an editor can have it
+// re-evaluated after every keystroke.  Only the tokens around an edit are
+// lexed again.  Subtrees whose tokens an edit did not touch are reused from
+// the old tree along with their values: parenthesized groups, and the runs of
+// up to RUN operands which longer chains are split into.  So an edit costs
+// time in proportion to its own length, the depth of the groups around it,
+// the number of runs in the chains which enclose it and how many tokens away
+// the previous edit was, rather than to the length of the line.
+class IncrementalCalculator {
+public:
+    IncrementalCalculator();
+    long            edit(size_t offset, size_t length, const string& text);
+    const string&   text() const;
+private:
+    static const size_t NONE = static_cast<size_t>(-1);
+    static const size_t RUN = 256;  // most operands in a run
+
+    // A subtree which was parsed from the tokens starting at a lexeme and
+    // how many tokens it took.
+    struct Parsed {
+        size_t  node;
+        size_t  span;
+    };
+
+    // A token, where it is in the text and the subtrees parsed from it: the
+    // group if it is an LPAREN, and the run of an expression's terms or of a
+    // term's factors which starts with it.  A bad lexeme marks where the
+    // lexer gave up; the error is only raised if parsing gets that far, just
+    // as Interpreter would.
+    struct Lexeme {
+        Token   token;
+        size_t  start;
+        size_t  end;
+        Parsed  group;
+        Parsed  terms;
+        Parsed  factors;
+        bool    bad;
+    };
+
+    string          _text;
+    vector<Lexeme>  _before;    // tokens before the last edit, and those
+    vector<Lexeme>  _after;     // after it in reverse, with their positions
+                                // counted back from the end of the text
+    size_t          _dirty_lo;  // tokens changed since the last successful
+    size_t          _dirty_hi;  // parse.  Subtrees overlapping them are stale.
+    Tree            _tree;
+    vector<long>    _values;    // value of each node in _tree
+    vector<bool>    _known;     // whether the value has been calculated
+    vector<bool>    _runs;      // whether a node's operands are runs
+    vector<bool>    _divides;   // whether there is a DIV in a run
+    size_t          _current;   // index of the current token when parsing
+    size_t          _last;      // and of the one after the last operand
+    vector<Operand> _stack;     // operands of the chains being built
+
+    void        lex(size_t offset, size_t length, size_t inserted);
+    size_t      count() const;
+    Lexeme&     at(size_t i);
+    Parsed&     run(size_t i, TOKENTYPE type);
+    bool        clean(size_t first, size_t last) const;
+    bool        reusable(size_t i, TOKENTYPE type);
+    TOKENTYPE   type();
+    bool        continues(TOKENTYPE type);
+    void        eat(TOKENTYPE token_type);
+    size_t      chain(TOKENTYPE type);
+    size_t      expression();
+    size_t      factor();
+    size_t      term();
+    void        unwind(size_t mark);
+    void        grow();
+    long        evaluate(size_t n);
+};
+
+// Constructor
+IncrementalCalculator::IncrementalCalculator() : _text{}, _before{},
+_after{}, _dirty_lo{NONE}, _dirty_hi{NONE}, _tree{}, _values{}, _known{},
+_runs{}, _divides{}, _current{0}, _last{NONE}, _stack{} {
+}
+
+// Replace length bytes of the text starting at offset with text and return
+// the new value.
+long IncrementalCalculator::edit(size_t offset, size_t length,
+const string& text) {
+    if (offset > _text.length()) {
+        offset = _text.length();
+    }
+    if (length > _text.length() - offset) {
+        length = _text.length() - offset;
+    }
+    _text.replace(offset, length, text);
+
+    lex(offset, length, text.length());
+
+    // Old nodes which were not reused are garbage.  Start afresh once there
+    // is too much of it.
+    if (_tree.size() + _tree.operands() > 8 * count() + 64) {
+        for (auto& lexeme : _before) {
+            lexeme.group = lexeme.terms = lexeme.factors = Parsed{NONE, 0};
+        }
+        for (auto& lexeme : _after) {
+            lexeme.group = lexeme.terms = lexeme.factors = Parsed{NONE, 0};
+        }
+        _tree.clear();
+        _values.clear();
+        _known.clear();
+        _runs.clear();
+        _divides.clear();
+    }
+
+    _current = 0;
+    _last = NONE;
+    _stack.clear();
+    size_t root = expression();
+
+    // Parsing stops at the first token which can't continue the expression.
+    // Any subtrees after that weren't checked so they may still be stale.
+    if (_dirty_lo != NONE) {
+        if (_dirty_hi > _current) {
+            _dirty_lo = max(_dirty_lo, _current);
+        } else {
+            _dirty_lo = _dirty_hi = NONE;
+        }
+    }
+    grow();
+
+    return evaluate(root);
+}
+
+const string& IncrementalCalculator::text() const {
+    return _text;
+}
+
+// Lex the text again after length bytes at offset were replaced by inserted
+// bytes.  The gap between the tokens kept from the start and those kept from
+// the end is moved to the edit first, so tokens after it need not be moved
+// or renumbered.  Lexing starts at the first token which touches the edit
+// and stops as soon as it produces a token identical to an old one past the
+// edit; from there on the old tokens are kept too.
+void IncrementalCalculator::lex(size_t offset, size_t length,
+size_t inserted) {
+    size_t size = _text.length() + length - inserted;   // before the edit
+
+    while (!_before.empty() && _before.back().end >= offset) {
+        _after.push_back(_before.back());
+        _before.pop_back();
+        _after.back().start = size - _after.back().start;
+        _after.back().end = size - _after.back().end;
+    }
+    while (!_after.empty() && size - _after.back().end < offset) {
+        _before.push_back(_after.back());
+        _after.pop_back();
+        _before.back().start = size - _before.back().start;
+        _before.back().end = size - _before.back().end;
+    }
+
+    size_t a = _before.size();
+    size_t from = offset;
+    size_t dropped = 0;
+    if (!_after.empty()) {
+        from = min(from, size - _after.back().start);
+    }
+    while (!_after.empty() && size - _after.back().start <= offset + length) {
+        _after.pop_back();
+        dropped++;
+    }
+
+    size_t edited = offset + inserted;  // end of the edit in the new text
+    Lexer lexer(_text, from);
+    try {
+        while (true) {
+            Token token = lexer.get_next_token();
+            if (token.type == TOKENTYPE::ENDOFFILE) {
+                dropped += _after.size();
+                _after.clear();
+                break;
+            }
+            size_t start = lexer.start();
+            size_t end = lexer.position();
+            if (start >= edited) {
+                while (!_after.empty() &&
+                _text.length() - _after.back().start < start) {
+                    _after.pop_back();
+                    dropped++;
+                }
+                if (!_after.empty() &&
+                _text.length() - _after.back().start == start &&
+                _text.length() - _after.back().end == end) {
+                    break;
+                }
+            }
+            _before.push_back(Lexeme{token, start, end, Parsed{NONE, 0},
+                Parsed{NONE, 0}, Parsed{NONE, 0}, false});
+        }
+    }
+    catch(const char*) {
+        // Nothing after this can be reached by the parser so there is no
+        // point in keeping it.
+        _before.push_back(Lexeme{Token(TOKENTYPE::ENDOFFILE, '\0'),
+            lexer.start(), lexer.start() + 1, Parsed{NONE, 0},
+            Parsed{NONE, 0}, Parsed{NONE, 0}, true});
+        dropped += _after.size();
+        _after.clear();
+    }
+
+    // Subtrees which enclose the edit have changed.  Rather than look for
+    // them now, remember which tokens changed and let the parser check.  The
+    // old tokens kept started at k before the edit.
+    size_t fresh = _before.size() - a;
+    size_t k = a + dropped;
+    size_t hi = a + fresh;
+    if (_dirty_lo != NONE) {
+        _dirty_lo = min(_dirty_lo, a);
+        if (_dirty_hi > k) {
+            hi = _dirty_hi - k + a + fresh;
+        }
+    } else {
+        _dirty_lo = a;
+    }
+    _dirty_hi = hi;
+}
+
+// Number of tokens.
+size_t IncrementalCalculator::count() const {
+    return _before.size() + _after.size();
+}
+
+// The token at index i.
+IncrementalCalculator::Lexeme& IncrementalCalculator::at(size_t i) {
+    if (i < _before.size()) {
+        return _before[i];
+    }
+    return _after[count() - 1 - i];
+}
+
+// The run of an expression's terms, if type is PLUS, or of a term's factors
+// kept at token i.
+IncrementalCalculator::Parsed& IncrementalCalculator::run(size_t i,
+TOKENTYPE type) {
+    Lexeme& lexeme = at(i);
+    return type == TOKENTYPE::PLUS ? lexeme.terms : lexeme.factors;
+}
+
+// Whether none of the tokens from first to last have changed since the last
+// successful parse.
+bool IncrementalCalculator::clean(size_t first, size_t last) const {
+    return last < _dirty_lo || first >= _dirty_hi;
+}
+
+// Whether the run of the given type kept at token i can be used again.  A
+// run depends on the token after it too, which is what ended it.
+bool IncrementalCalculator::reusable(size_t i, TOKENTYPE type) {
+    if (i >= count()) {
+        return false;
+    }
+
+    const Parsed& parsed = run(i, type);
+    return parsed.node != NONE && clean(i, i + parsed.span);
+}
+
+// The type of the current token.  If the lexer could not make sense of the
+// text here, raise the error it did.
+TOKENTYPE IncrementalCalculator::type() {
+    if (_current >= count()) {
+        return TOKENTYPE::ENDOFFILE;
+    }
+
+    const Lexeme& lexeme = at(_current);
+    if (lexeme.bad) {
+        Lexer lexer(_text, _current < _before.size() ? lexeme.start :
+            _text.length() - lexeme.start);
+        lexer.get_next_token();
+    }
+
+    return lexeme.token.type;
+}
+
+// Whether the current token is an operator of chains of the given type.
+bool IncrementalCalculator::continues(TOKENTYPE type) {
+    TOKENTYPE next = this->type();
+
+    if (type == TOKENTYPE::PLUS) {
+        return next == TOKENTYPE::PLUS || next == TOKENTYPE::MINUS;
+    }
+    return next == TOKENTYPE::MUL || next == TOKENTYPE::DIV;
+}
+
+// compare the current token type with the passed token type and if they match
+// then "eat" the current token and move on to the next one, otherwise raise
+// an exception.  Any runs kept at an eaten token are being parsed afresh, and
+// are kept again once they are done, or are no longer runs at all.
+void IncrementalCalculator::eat(TOKENTYPE token_type) {
+    if (type() == token_type) {
+        Lexeme& lexeme = at(_current++);
+        lexeme.terms = lexeme.factors = Parsed{NONE, 0};
+    } else {
+        PROBE2(eat__mismatch, static_cast<int>(token_type),
+            static_cast<int>(type()));
+        error("Error parsing input. Wanted: ", name(token_type));
+    }
+}
+
+// Parse a chain of operands joined by operators of the given type, an
+// expression or a term.  A chain of more than RUN operands is built of runs
+// of them, each kept at its first token: the chain's first, or the operator
+// before its first operand.  A run is worked out the same wherever it is
+// found so it can be reused, even if the chain around it has changed.
+size_t IncrementalCalculator::chain(TOKENTYPE type) {
+    size_t mark = _stack.size();
+    size_t first = _current;
+
+    try {
+        do {
+            size_t start = _current;
+            if (reusable(start, type)) {
+                const Parsed& parsed = run(start, type);
+                _current += parsed.span;
+                _stack.push_back(Operand{type, parsed.node});
+                continue;
+            }
+
+            size_t operands = _stack.size();
+            TOKENTYPE op = type;
+            if (start != first) {
+                op = this->type();
+                eat(op);
+            }
+            _stack.push_back(Operand{op,
+                type == TOKENTYPE::PLUS ? term() : factor()});
+            _last = _current;
+            while (continues(type) && _stack.size() - operands < RUN &&
+            !reusable(_current, type)) {
+                op = this->type();
+                eat(op);
+                _stack.push_back(Operand{op,
+                    type == TOKENTYPE::PLUS ? term() : factor()});
+                _last = _current;
+            }
+
+            // A chain of one operand is just that operand.
+            if (start == first && _stack.size() - operands == 1 &&
+            !continues(type)) {
+                size_t node = _stack.back().node;
+                _stack.pop_back();
+                return node;
+            }
+
+            bool divides = false;
+            for (size_t i = operands; i < _stack.size(); i++) {
+                divides = divides || _stack[i].op == TOKENTYPE::DIV;
+            }
+            size_t node = _tree.chain(type, &_stack[operands],
+                _stack.size() - operands);
+            _stack.resize(operands);
+            _stack.push_back(Operand{type, node});
+            grow();
+            _divides[node] = divides;
+
+            run(start, type) = Parsed{node, _current - start};
+        } while (continues(type));
+    }
+    catch(const char*) {
+        unwind(mark);
+        throw;
+    }
+
+    size_t node = _stack[mark].node;
+    if (_stack.size() - mark > 1) {
+        node = _tree.chain(type, &_stack[mark], _stack.size() - mark);
+        grow();
+        _runs[node] = true;
+    }
+    _stack.resize(mark);
+
+    return node;
+}
+
+// expr : term ((PLUS | MINUS) term)*
+size_t IncrementalCalculator::expression() {
+    return chain(TOKENTYPE::PLUS);
+}
+
+// factor : INTEGER | LPAREN expr RPAREN
+//
+// A group which is still as it was last time is not parsed again.  Whatever
+// runs of an expression or a term were kept at it are stale unless those are
+// being parsed afresh too, in which case they will be kept again when done.
+size_t IncrementalCalculator::factor() {
+    TOKENTYPE token_type = type();
+
+    if (token_type == TOKENTYPE::INTEGER) {
+        long value = at(_current).token.value;
+        eat(TOKENTYPE::INTEGER);
+        return _tree.integer(value);
+    } else if (token_type == TOKENTYPE::LPAREN) {
+        size_t lparen = _current;
+        Lexeme& lexeme = at(lparen);
+        lexeme.terms = lexeme.factors = Parsed{NONE, 0};
+        if (lexeme.group.node != NONE &&
+        clean(lparen, lparen + lexeme.group.span - 1)) {
+            _current += lexeme.group.span;
+            return lexeme.group.node;
+        }
+        eat(TOKENTYPE::LPAREN);
+        size_t node = expression();
+        if (type() != TOKENTYPE::RPAREN) {
+            // Interpreter would have evaluated the group before finding it
+            // wasn't closed.
+            grow();
+            evaluate(node);
+        }
+        eat(TOKENTYPE::RPAREN);
+        at(lparen).group = Parsed{node, _current - lparen};
+        return node;
+    } else {
+        error("Error parsing input. Wanted: Integer or (");
+    }
+}
+
+// term : factor ((MUL | DIV) factor)*
+//
+// A run of an expression's terms kept at the first token is stale unless
+// that is being parsed afresh too, as for factor().
+size_t IncrementalCalculator::term() {
+    if (_current < count()) {
+        at(_current).terms = Parsed{NONE, 0};
+    }
+    return chain(TOKENTYPE::MUL);
+}
+
+// Parsing has failed with the operands since mark on the stack.  Interpreter
+// evaluates as it parses, so it would have run into any division by zero
+// among them first.  It only divides once it has lexed the token after the
+// divisor though, so if that is where the lexer gave up it never did the
+// last division.
+void IncrementalCalculator::unwind(size_t mark) {
+    bool lexed = _current >= count() || !at(_current).bad ||
+        _last != _current;
+
+    _last = NONE;
+    grow();
+    for (size_t i = mark; i < _stack.size(); i++) {
+        long value = evaluate(_stack[i].node);
+        if (_stack[i].op == TOKENTYPE::DIV &&
+        (lexed || i + 1 < _stack.size())) {
+            apply(TOKENTYPE::DIV, 1, value);
+        }
+    }
+    _stack.resize(mark);
+}
+
+// Make room for what is known about nodes added to the tree.
+void IncrementalCalculator::grow() {
+    _values.resize(_tree.size());
+    _known.resize(_tree.size());
+    _runs.resize(_tree.size());
+    _divides.resize(_tree.size());
+}
+
+// Evaluate the subtree at node n, using the values of nodes that have already
+// been calculated.  Every operand is applied to what came before it, starting
+// from nothing, so a run which starts with an operator has a value of its own
+// to add or multiply by, unless it divides.  Then it has to be applied one
+// operand at a time.
+long IncrementalCalculator::evaluate(size_t n) {
+    if (_known[n]) {
+        return _values[n];
+    }
+
+    const AST& node = _tree.node(n);
+    long result = node.value;
+    if (node.type != TOKENTYPE::INTEGER) {
+        result = node.type == TOKENTYPE::PLUS ? 0 : 1;
+        for (size_t i = node.first; i < node.first + node.count; i++) {
+            const Operand& operand = _tree.operand(i);
+            if (!_runs[n]) {
+                result = apply(operand.op, result, evaluate(operand.node));
+            } else if (!_divides[operand.node]) {
+                result = apply(node.type, result, evaluate(operand.node));
+            } else {
+                const AST& run = _tree.node(operand.node);
+                for (size_t j = run.first; j < run.first + run.count; j++) {
+                    result = apply(_tree.operand(j).op, result,
+                        evaluate(_tree.operand(j).node));
+                }
+            }
+        }
+    }
+
+    _values[n] = result;
+    _known[n] = true;
+    return result;
+}
+
+// Lines at least this long are parsed into a tree and evaluated in parallel.
+const size_t PARALLEL_THRESHOLD = 1 << 16;
+
+// The pool which long lines are evaluated on.
+WorkStealingPool& pool() {
+    static WorkStealingPool pool(thread::hardware_concurrency() > 1 ?
+        thread::hardware_concurrency() - 1 : 0);
+    return pool;
+}
+
+// Whether length bytes of expression are worth evaluating on the pool.  With
+// no threads to share the work, building the tree costs more than it saves
+// and Interpreter is faster.
+bool parallel(size_t length) {
+    return length >= PARALLEL_THRESHOLD && pool().threads() > 0;
+}
+
+// Evaluate the expression whose first token lexer handed out at start with
+// Interpreter.  A tree is only evaluated once all of its expression has
+// parsed, but Interpreter evaluates as it goes and so may run into a
+// division by zero before the token it can't parse.  When parsing fails this
+// gets the error Interpreter would have given.
+long interpret(TokenSource& lexer, size_t start) {
+    lexer.rewind(start);
+    Interpreter interpreter(lexer);
+    interpreter.next();
+    return interpreter.expression();
+}
+
+// Calculate the value of the first expression in the tokens from lexer.  It
+// goes through a tree if there are enough tokens to be worth evaluating in
+// parallel or if values of groups are being memoized.  text, if known, is
+// what the tokens came from.
+long calculate(TokenSource& lexer, bool large, const string* text = nullptr) {
+    Stats::Line line(text);
+
+    if (large || Tree::memo) {
+        static thread_local Tree tree;
+
+        tree.clear();
+        Parser parser(lexer, tree);
+        parser.next();
+        size_t start = lexer.start();
+        try {
+            Stats::Timer timer(Stats::PARSE);
+            parser.parse();
+        }
+        catch(const char*) {
+            Stats::Timer timer(Stats::PARSE);
+            return interpret(lexer, start);
+        }
+
+        Stats::Timer timer(Stats::EVAL);
+        if (large) {
+            return pool().evaluate(tree);
+        }
+        return tree.evaluate(tree.root());
+    }
+
+    Interpreter interpreter(lexer);
+    interpreter.next();
+    Stats::Timer timer(Stats::PARSE);
+    return interpreter.expression();
+}
+
+// Calculate the value of the first expression on a line of input.
+long calculate(string& text) {
+    Lexer lexer(text);
+    return calculate(lexer, parallel(text.length()), &text);
+}
+
+// Calculate each of the expressions separated by SEMI on a line of input in
+// one pass, calling done(result, error) for each in turn; error is nullptr
+// unless the expression could not be evaluated.  An error only costs the
+// expression it is in.
+template<typename F>
+void calculate_each(string& text, F done) {
+    Stats::Line line(&text);
+    Lexer lexer(text);
+    bool large = parallel(text.length());
+
+    if (large || Tree::memo) {
+        static thread_local Tree tree;
+        Parser parser(lexer, tree);
+
+        parser.next();
+        do {
+            long result;
+            size_t start = lexer.start();
+            try {
+                tree.clear();
+                {
+                    Stats::Timer timer(Stats::PARSE);
+                    parser.parse();
+                }
+            }
+            catch(const char*) {
+                try {
+                    Stats::Timer timer(Stats::PARSE);
+                    result = interpret(lexer, start);
+                    done(result, nullptr);
+                }
+                catch(const char* error) {
+                    done(0, error);
+                }
+                lexer.rewind(start);
+                parser.skip();
+                continue;
+            }
+            try {
+                Stats::Timer timer(Stats::EVAL);
+                result = large ? pool().evaluate(tree) :
+                    tree.evaluate(tree.root());
+            }
+            catch(const char* error) {
+                done(0, error);
+                continue;
+            }
+            done(result, nullptr);
+        } while (parser.next());
+        return;
+    }
+
+    Interpreter interpreter(lexer);
+    interpreter.next();
+    do {
+        long result;
+        try {
+            Stats::Timer timer(Stats::PARSE);
+            result = interpreter.expression();
+        }
+        catch(const char* error) {
+            done(0, error);
+            continue;
+        }
+        done(result, nullptr);
+    } while (interpreter.next());
+}
+
+// Append n in decimal to output.  Digits are made two at a time, from the
+// right, by looking up the last two in a table, so there is half as much
+// dividing as there would be one digit at a time and no locale to consult.
+void put_decimal(string& output, long n) {
+    static const char DIGITS[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char buffer[20];
+    char* p = buffer + sizeof(buffer);
+    unsigned long u = n < 0 ? 0 - static_cast<unsigned long>(n) :
+        static_cast<unsigned long>(n);
+
+    while (u >= 100) {
+        size_t i = (u % 100) * 2;
+        u /= 100;
+        *--p = DIGITS[i + 1];
+        *--p = DIGITS[i];
+    }
+    if (u >= 10) {
+        *--p = DIGITS[u * 2 + 1];
+        *--p = DIGITS[u * 2];
+    } else {
+        *--p = static_cast<char>('0' + u);
+    }
+    if (n < 0) {
+        *--p = '-';
+    }
+
+    output.append(p, static_cast<size_t>(buffer + sizeof(buffer) - p));
+}
+
+void count_error(const char* error);
+
+// Evaluate one line of input and append the result, or the error message if
+// it could not be evaluated, to output.  A line with several expressions
+// separated by ';' gets a line of output for each.
+void evaluate(string& text, string& output) {
+    calculate_each(text, [&output](long result, const char* error) {
+        Stats::Timer timer(Stats::OUTPUT);
+        if (error) {
+            count_error(error);
+            output += error;
+        } else {
+            put_decimal(output, result);
+        }
+        output += '\n';
+    });
+}
+
+// The binary protocol.  Every message is a frame: a 32-bit little-endian
+// length followed by that many bytes.  A request frame starts with a kind
+// byte; an EXPRESSION is followed by the text of the expression, which may
+// not contain NUL, TOKENS by records of a type byte (a TOKENTYPE) and a
+// 64-bit little-endian value, so a client which already has the tokens can
+// skip the lexer.  The response frame is a status byte followed by the
+// 64-bit little-endian result, which is 0 unless the status is OK.
+enum class FRAMEKIND : uint8_t {
+    EXPRESSION = 0,
+    TOKENS = 1
+};
+
+enum class STATUS : uint8_t {
+    OK = 0,
+    PARSE_ERROR,
+    DIVISION_BY_ZERO,
+    BAD_REQUEST
+};
+
+// The status for an error thrown while evaluating.
+STATUS status_of(const char* error) {
+    return strcmp(error, "Division by zero") == 0 ? STATUS::DIVISION_BY_ZERO :
+        STATUS::PARSE_ERROR;
+}
+
+void count_error(STATUS status);
+
+const size_t FRAMEHEADER = 4;
+const size_t TOKENRECORD = 9;
+const size_t RESPONSE = 9;
+
+uint32_t get_u32(const char* p) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | static_cast<uint32_t>(b[1]) << 8 |
+        static_cast<uint32_t>(b[2]) << 16 | static_cast<uint32_t>(b[3]) << 24;
+}
+
+uint64_t get_u64(const char* p) {
+    return get_u32(p) | static_cast<uint64_t>(get_u32(p + 4)) << 32;
+}
+
+void put_u32(string& output, uint32_t n) {
+    for (int i = 0; i < 4; i++) {
+        output += static_cast<char>(n >> (8 * i) & 0xFF);
+    }
+}
+
+void put_u64(string& output, uint64_t n) {
+    put_u32(output, static_cast<uint32_t>(n));
+    put_u32(output, static_cast<uint32_t>(n >> 32));
+}
+
+// Append a response frame to output.
+void respond(STATUS status, long result, string& output) {
+    put_u32(output, RESPONSE);
+    output += static_cast<char>(status);
+    put_u64(output, static_cast<uint64_t>(result));
+}
+
+// Append the response to a request which makes no sense to output.
+void reject(string& output) {
+    count_error(STATUS::BAD_REQUEST);
+    respond(STATUS::BAD_REQUEST, 0, output);
+}
+
+// Evaluate the body of one request frame and append the response to output.
+void evaluate_frame(string& frame, string& output) {
+    static thread_local vector<Token> tokens;
+
+    if (frame.empty()) {
+        reject(output);
+        return;
+    }
+
+    try {
+        long result;
+        if (static_cast<FRAMEKIND>(frame[0]) == FRAMEKIND::EXPRESSION) {
+            // The lexer would take a NUL for the end of the text and
+            // quietly ignore the rest.
+            if (memchr(frame.data() + 1, '\0', frame.length() - 1)) {
+                reject(output);
+                return;
+            }
+            frame.erase(0, 1);
+            result = calculate(frame);
+        } else if (static_cast<FRAMEKIND>(frame[0]) == FRAMEKIND::TOKENS &&
+        (frame.length() - 1) % TOKENRECORD == 0) {
+            tokens.clear();
+            for (size_t i = 1; i < frame.length(); i += TOKENRECORD) {
+                auto type = static_cast<unsigned char>(frame[i]);
+                if (type > static_cast<unsigned char>(TOKENTYPE::SEMI)) {
+                    reject(output);
+                    return;
+                }
+                if (type == static_cast<unsigned char>(TOKENTYPE::ENDOFFILE)) {
+                    break;
+                }
+                tokens.emplace_back(static_cast<TOKENTYPE>(type),
+                    static_cast<long>(get_u64(&frame[i + 1])));
+            }
+            TokenStream stream(tokens.data(), tokens.size());
+            // Roughly four bytes of text per token.
+            result = calculate(stream, parallel(tokens.size() * 4));
+        } else {
+            reject(output);
+            return;
+        }
+        respond(STATUS::OK, result, output);
+    }
+    catch(const char* error) {
+        count_error(error);
+        respond(status_of(error), 0, output);
+    }
+}
+
+// Lines and bytes of input handled by a batch run.
+struct Tally {
+    size_t  lines;
+    size_t  bytes;
+};
+
+// Write all of length bytes of data to fd.
+void write_all(int fd, const char* data, size_t length) {
+    while (length) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error(string("Can't write output: ") + strerror(errno));
+        }
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+}
+
+// Write all of output to fd and empty it.
+void write_all(int fd, string& output) {
+    write_all(fd, output.data(), output.length());
+    output.clear();
+}
+
+// Writes results as columns in a file which another program can mmap rather
+// than having to parse text.  After a HEADER-byte header the file is made of
+// blocks of BLOCKROWS rows each, so where row i is can be worked out without
+// reading anything else.  A block holds, one after the other, the results as
+// 64-bit little-endian integers, a validity bitmap with bit i % 8 of byte
+// i / 8 set if row i has a result, and a byte per row holding its STATUS.
+// The last block is padded out to full size with invalid rows.
+//
+// The header is, all little-endian:
+//      0   "calc6col"
+//      8   uint32 format version, 1
+//      12  uint32 rows per block
+//      16  uint64 rows
+//      24  uint64 bytes per block
+//      32  uint64 offset of the bitmap within a block
+//      40  uint64 offset of the statuses within a block
+//      48  zeroes up to HEADER
+//
+// The number of rows is only known at the end so the header is written
+// again then; the output must be a file that can be written at any offset.
+class ColumnWriter {
+public:
+    ColumnWriter(const string& path);
+    ~ColumnWriter();
+    void    add(long result, const char* error);
+    void    finish();
+private:
+    static const size_t HEADER = 64;
+    static const size_t BLOCKROWS = 1 << 16;
+    static const size_t BITMAP = BLOCKROWS * 8;
+    static const size_t STATUSES = BITMAP + BLOCKROWS / 8;
+    static const size_t BLOCKSIZE = STATUSES + BLOCKROWS;
+
+    int             _fd;
+    uint64_t        _rows;
+    string          _block;
+
+    void    header();
+};
+
+// Constructor
+ColumnWriter::ColumnWriter(const string& path) : _fd{-1}, _rows{0},
+_block(BLOCKSIZE, '\0') {
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        error("Can't open " + path + ": " + strerror(errno));
+    }
+    if (lseek(_fd, 0, SEEK_CUR) < 0) {
+        ::close(_fd);
+        error(path + " is not a file columns can be written to");
+    }
+    header();
+}
+
+// Destructor
+ColumnWriter::~ColumnWriter() {
+    ::close(_fd);
+}
+
+// Add a row, which has no value if error isn't nullptr.
+void ColumnWriter::add(long result, const char* error) {
+    size_t row = _rows++ % BLOCKROWS;
+    uint64_t value = error ? 0 : static_cast<uint64_t>(result);
+
+    for (size_t i = 0; i < 8; i++) {
+        _block[row * 8 + i] = static_cast<char>(value >> (8 * i) & 0xFF);
+    }
+    if (!error) {
+        _block[BITMAP + row / 8] |= static_cast<char>(1 << (row % 8));
+    }
+    _block[STATUSES + row] = static_cast<char>(error ? status_of(error) :
+        STATUS::OK);
+
+    if (row == BLOCKROWS - 1) {
+        write_all(_fd, _block.data(), _block.length());
+        _block.assign(BLOCKSIZE, '\0');
+    }
+}
+
+// Write out the last block and the final header.
+void ColumnWriter::finish() {
+    if (_rows % BLOCKROWS) {
+        write_all(_fd, _block.data(), _block.length());
+    }
+    if (lseek(_fd, 0, SEEK_SET) < 0) {
+        error(string("Can't seek output: ") + strerror(errno));
+    }
+    header();
+}
+
+// Write the header at the current position.
+void ColumnWriter::header() {
+    string header("calc6col");
+
+    put_u32(header, 1);
+    put_u32(header, BLOCKROWS);
+    put_u64(header, _rows);
+    put_u64(header, BLOCKSIZE);
+    put_u64(header, BITMAP);
+    put_u64(header, STATUSES);
+    header.resize(HEADER, '\0');
+    write_all(_fd, header);
+}
+
+// Evaluate one line of input into columns, a row per expression.
+void evaluate(string& text, ColumnWriter& columns) {
+    calculate_each(text, [&columns](long result, const char* error) {
+        Stats::Timer timer(Stats::OUTPUT);
+        columns.add(result, error);
+    });
+}
+
+// Evaluate every line of in without stopping at errors, writing one line of
+// output, the result or the error, per line of input.  Output is collected
+// and written to the descriptor out in large blocks rather than flushed after
+// every line.  If columns is set, results go there instead.
+Tally batch(istream& in, int out, ColumnWriter* columns) {
+    const size_t BUFFERSIZE = 1 << 16;
+    Tally tally{0, 0};
+    string output;
+    string text;
+
+    output.reserve(BUFFERSIZE + 256);
+    while (getline(in, text)) {
+        tally.lines++;
+        tally.bytes += text.length() + 1;
+        if (columns) {
+            evaluate(text, *columns);
+            continue;
+        }
+        evaluate(text, output);
+        if (output.length() >= BUFFERSIZE) {
+            write_all(out, output);
+        }
+    }
+
+    write_all(out, output);
+    return tally;
+}
+
+// The same but writing each result to out as the REPL does, through the
+// stream's number formatting and a flush per line.  It is only here to be
+// compared with the above.
+Tally batch(istream& in, ostream& out) {
+    Tally tally{0, 0};
+    string text;
+
+    while (getline(in, text)) {
+        tally.lines++;
+        tally.bytes += text.length() + 1;
+        calculate_each(text, [&out](long result, const char* error) {
+            if (error) {
+                out << error << endl;
+            } else {
+                out << result << endl;
+            }
+        });
+    }
+
+    return tally;
+}
+
+// Somewhere to read input from in large blocks.
+class Source {
+public:
+    virtual ~Source();
+
+    // Return the next block of input.  It stays valid until the next call.
+    // Returns false at the end of the input.
+    virtual bool read(const char*& data, size_t& length) = 0;
+};
+
+Source::~Source() {
+}
+
+// Reads blocks with plain read(2).
+class FdSource : public Source {
+public:
+    FdSource(int fd);
+    bool read(const char*& data, size_t& length) override;
+private:
+    static const size_t BLOCKSIZE = 1 << 20;
+
+    int             _fd;
+    vector<char>    _block;
+};
+
+// Constructor
+FdSource::FdSource(int fd) : _fd{fd}, _block(BLOCKSIZE) {
+}
+
+bool FdSource::read(const char*& data, size_t& length) {
+    ssize_t n;
+    do {
+        n = ::read(_fd, _block.data(), _block.size());
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        error(string("Can't read input: ") + strerror(errno));
+    }
+
+    data = _block.data();
+    length = static_cast<size_t>(n);
+    return n > 0;
+}
+
+// Reads a regular file with io_uring.  The buffers are registered with the
+// kernel up front and DEPTH reads of consecutive blocks are kept in flight,
+// so while one block is being lexed and evaluated the kernel is filling the
+// next ones.  The constructor throws if io_uring can't be used here, e.g. on
+// an old kernel or if the input is not a regular file.
+class UringSource : public Source {
+public:
+    UringSource(int fd);
+    ~UringSource();
+    bool read(const char*& data, size_t& length) override;
+private:
+    static const size_t BLOCKSIZE = 1 << 20;
+    static const unsigned DEPTH = 4;
+
+    // A buffer and the read going on in it.
+    struct Slot {
+        off_t   offset;
+        size_t  length;     // how much is being asked for
+        int     result;     // bytes read, or -errno
+        bool    pending;    // submitted but not yet completed
+    };
+
+    int             _fd;
+    int             _ring;
+    off_t           _size;      // of the file
+    off_t           _offset;    // where the next read to be submitted is
+    unsigned        _current;   // the slot to be returned next
+    bool            _held;      // the previous slot is with the caller
+    vector<char>    _memory;
+    Slot            _slots[DEPTH];
+    void*           _sq;
+    size_t          _sq_size;
+    void*           _cq;
+    size_t          _cq_size;
+    io_uring_sqe*   _sqes;
+    size_t          _sqes_size;
+    unsigned*       _sq_tail;
+    unsigned*       _sq_mask;
+    unsigned*       _sq_array;
+    unsigned*       _cq_head;
+    unsigned*       _cq_tail;
+    unsigned*       _cq_mask;
+    io_uring_cqe*   _cqes;
+
+    void    submit(unsigned slot);
+    void    reap();
+    void    release();
+};
+
+// Constructor
+UringSource::UringSource(int fd) : _fd{fd}, _ring{-1}, _size{0}, _offset{0},
+_current{0}, _held{false}, _memory(BLOCKSIZE * DEPTH), _slots{}, _sq{nullptr},
+_sq_size{0}, _cq{nullptr}, _cq_size{0}, _sqes{nullptr}, _sqes_size{0},
+_sq_tail{nullptr}, _sq_mask{nullptr}, _sq_array{nullptr}, _cq_head{nullptr},
+_cq_tail{nullptr}, _cq_mask{nullptr}, _cqes{nullptr} {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        error("io_uring needs a regular file");
+    }
+    _size = st.st_size;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    _ring = static_cast<int>(syscall(__NR_io_uring_setup, DEPTH, &params));
+    if (_ring < 0) {
+        error(string("io_uring unavailable: ") + strerror(errno));
+    }
+
+    _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_size = _cq_size = max(_sq_size, _cq_size);
+    }
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    _sq = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    _cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? _sq :
+        mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+    if (_sq == MAP_FAILED || _cq == MAP_FAILED || sqes == MAP_FAILED) {
+        _sq = _sq == MAP_FAILED ? nullptr : _sq;
+        _cq = _cq == MAP_FAILED ? nullptr : _cq;
+        _sqes = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+        release();
+        error("Can't map io_uring");
+    }
+    _sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(_sq);
+    char* cq = static_cast<char*>(_cq);
+    _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    _sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    _cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    iovec buffers[DEPTH];
+    for (unsigned i = 0; i < DEPTH; i++) {
+        buffers[i].iov_base = &_memory[i * BLOCKSIZE];
+        buffers[i].iov_len = BLOCKSIZE;
+    }
+    if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS,
+    buffers, DEPTH) < 0) {
+        release();
+        error(string("Can't register buffers: ") + strerror(errno));
+    }
+
+    for (unsigned i = 0; i < DEPTH; i++) {
+        submit(i);
+    }
+}
+
+// Destructor
+UringSource::~UringSource() {
+    release();
+}
+
+// Unmap the rings and close the io_uring.
+void UringSource::release() {
+    if (_sqes) {
+        munmap(_sqes, _sqes_size);
+        _sqes = nullptr;
+    }
+    if (_cq && _cq != _sq) {
+        munmap(_cq, _cq_size);
+    }
+    _cq = nullptr;
+    if (_sq) {
+        munmap(_sq, _sq_size);
+        _sq = nullptr;
+    }
+    if (_ring >= 0) {
+        ::close(_ring);
+        _ring = -1;
+    }
+}
+
+// Start reading the next block of the file into slot, if there is any of
+// the file left.
+void UringSource::submit(unsigned slot) {
+    Slot& s = _slots[slot];
+    s.pending = false;
+    s.result = 0;
+    s.length = 0;
+    if (_offset >= _size) {
+        return;
+    }
+    s.offset = _offset;
+    s.length = static_cast<size_t>(min<off_t>(BLOCKSIZE, _size - _offset));
+    _offset += static_cast<off_t>(s.length);
+
+    unsigned tail = *_sq_tail;
+    unsigned index = tail & *_sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = _fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&_memory[slot * BLOCKSIZE]);
+    sqe->len = static_cast<uint32_t>(s.length);
+    sqe->off = static_cast<uint64_t>(s.offset);
+    sqe->buf_index = static_cast<uint16_t>(slot);
+    sqe->user_data = slot;
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    s.pending = true;
+
+    if (syscall(__NR_io_uring_enter, _ring, 1, 0, 0, nullptr, 0) < 0) {
+        error(string("io_uring_enter failed: ") + strerror(errno));
+    }
+}
+
+// Wait for at least one read to complete and note the results of all those
+// which have.
+void UringSource::reap() {
+    unsigned head = *_cq_head;
+
+    while (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS,
+        nullptr, 0) < 0 && errno != EINTR) {
+            error(string("io_uring_enter failed: ") + strerror(errno));
+        }
+    }
+
+    while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe& cqe = _cqes[head & *_cq_mask];
+        Slot& s = _slots[cqe.user_data];
+        s.result = cqe.res;
+        s.pending = false;
+        head++;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+}
+
+bool UringSource::read(const char*& data, size_t& length) {
+    // The caller is done with the block it had; refill it.
+    if (_held) {
+        submit((_current + DEPTH - 1) % DEPTH);
+        _held = false;
+    }
+
+    Slot& s = _slots[_current];
+    if (s.length == 0) {
+        return false;
+    }
+    while (s.pending) {
+        reap();
+    }
+    if (s.result < 0) {
+        error(string("Can't read input: ") + strerror(-s.result));
+    }
+
+    // Reads of a regular file are only short at the end, but make sure.
+    char* buffer = &_memory[_current * BLOCKSIZE];
+    size_t done = static_cast<size_t>(s.result);
+    while (done < s.length) {
+        ssize_t n = pread(_fd, buffer + done, s.length - done,
+            s.offset + static_cast<off_t>(done));
+        if (n <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+
+    data = buffer;
+    length = done;
+    _current = (_current + 1) % DEPTH;
+    _held = true;
+    return true;
+}
+
+// Like batch() above but reading blocks from a Source and splitting them into
+// lines itself.
+Tally batch(Source& source, int out, ColumnWriter* columns) {
+    const size_t BUFFERSIZE = 1 << 16;
+    Tally tally{0, 0};
+    string output;
+    string text;
+    const char* data;
+    size_t length;
+
+    output.reserve(BUFFERSIZE + 256);
+    while (source.read(data, length)) {
+        tally.bytes += length;
+        const char* end = data + length;
+        while (data < end) {
+            const char* newline = static_cast<const char*>(
+                memchr(data, '\n', static_cast<size_t>(end - data)));
+            if (newline == nullptr) {
+                text.append(data, end);     // continued in the next block
+                break;
+            }
+            text.append(data, newline);
+            data = newline + 1;
+
+            tally.lines++;
+            if (columns) {
+                evaluate(text, *columns);
+            } else {
+                evaluate(text, output);
+            }
+            text.clear();
+            if (output.length() >= BUFFERSIZE) {
+                write_all(out, output);
+            }
+        }
+    }
+
+    if (!text.empty()) {
+        tally.lines++;
+        if (columns) {
+            evaluate(text, *columns);
+        } else {
+            evaluate(text, output);
+        }
+    }
+
+    write_all(out, output);
+    return tally;
+}
+
+// A run of consecutive input lines and, once a worker has been through them,
+// their results.
+struct Batch {
+    size_t          seq;    // position of this batch in the input
+    vector<string>  lines;
+    string          output;
+};
+
+// Evaluates lines on a pool of worker threads.  Each worker has its own
+// Lexer and Interpreter so nothing is shared while evaluating.  Results are
+// collected in a reorder buffer and written out in the same order as the
+// input.
+class ParallelEvaluator {
+public:
+    ParallelEvaluator(size_t jobs);
+    void run(istream& in, ostream& out);
+private:
+    static const size_t BATCHSIZE = 256;    // lines handed to a worker at once
+
+    size_t                  _jobs;
+    size_t                  _window;        // most batches in flight at once
+    mutex                   _lock;
+    condition_variable      _work_ready;
+    condition_variable      _result_ready;
+    condition_variable      _space_ready;
+    deque<Batch>            _work;
+    map<size_t, string>     _results;       // the reorder buffer
+    size_t                  _next;          // next batch to be written
+    size_t                  _total;         // batches read so far
+    bool                    _eof;
+
+    void read(istream& in);
+    void work();
+    void write(ostream& out);
+};
+
+// Constructor
+ParallelEvaluator::ParallelEvaluator(size_t jobs) : _jobs{jobs},
+_window{jobs * 4}, _lock{}, _work_ready{}, _result_ready{}, _space_ready{},
+_work{}, _results{}, _next{0}, _total{0}, _eof{false} {
+}
+
+// Read input into batches and hand them to the workers until input runs out.
+// Reading stops while too many batches are waiting to be written so memory
+// use stays bounded however large the input is.
+void ParallelEvaluator::read(istream& in) {
+    Batch batch{0, {}, {}};
+    string text;
+
+    while (true) {
+        bool more = static_cast<bool>(getline(in, text));
+        if (more) {
+            batch.lines.push_back(move(text));
+            if (batch.lines.size() < BATCHSIZE) {
+                continue;
+            }
+        }
+
+        unique_lock<mutex> guard(_lock);
+        if (!batch.lines.empty()) {
+            _space_ready.wait(guard, [this] {
+                return _total - _next < _window;
+            });
+            batch.seq = _total++;
+            _work.push_back(move(batch));
+            batch = Batch{0, {}, {}};
+            _work_ready.notify_one();
+        }
+        if (!more) {
+            _eof = true;
+            _work_ready.notify_all();
+            _result_ready.notify_all();
+            return;
+        }
+    }
+}
+
+// Take batches off the work queue and evaluate them.
+void ParallelEvaluator::work() {
+    while (true) {
+        Batch batch{0, {}, {}};
+        {
+            unique_lock<mutex> guard(_lock);
+            _work_ready.wait(guard, [this] {
+                return !_work.empty() || _eof;
+            });
+            if (_work.empty()) {
+                return;
+            }
+            batch = move(_work.front());
+            _work.pop_front();
+        }
+
+        for (auto& text : batch.lines) {
+            evaluate(text, batch.output);
+        }
+
+        lock_guard<mutex> guard(_lock);
+        _results.emplace(batch.seq, move(batch.output));
+        _result_ready.notify_all();
+    }
+}
+
+// Write results in input order as they become available.
+void ParallelEvaluator::write(ostream& out) {
+    while (true) {
+        string output;
+        {
+            unique_lock<mutex> guard(_lock);
+            _result_ready.wait(guard, [this] {
+                return _results.count(_next) || (_eof && _next == _total);
+            });
+            auto it = _results.find(_next);
+            if (it == _results.end()) {
+                return;
+            }
+            output = move(it->second);
+            _results.erase(it);
+            _next++;
+            _space_ready.notify_one();
+        }
+        out << output;
+    }
+}
+
+// Evaluate all of in, writing one line of output per line of input to out.
+void ParallelEvaluator::run(istream& in, ostream& out) {
+    vector<thread> workers;
+    for (size_t i = 0; i < _jobs; i++) {
+        workers.emplace_back(&ParallelEvaluator::work, this);
+    }
+    thread reader(&ParallelEvaluator::read, this, ref(in));
+
+    write(out);
+
+    reader.join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    out.flush();
+}
+
+// Lock-free ring buffer for handing items from exactly one producer thread to
+// exactly one consumer thread.  A side which can't go on spins for a while
+// and then sleeps until the other side wakes it; the other side only takes
+// the lock when someone is asleep.
+template<typename T>
+class SpscRing {
+public:
+    SpscRing(size_t size);
+    bool    push(T& item);
+    bool    pop(T& item);
+    void    wait_for_room();
+    void    wait_for_item();
+    void    close();
+    bool    closed() const;
+    size_t  depth() const;
+private:
+    static const size_t SPINS = 1 << 10;    // checks before going to sleep
+
+    vector<T>           _items;
+    size_t              _mask;
+    atomic<size_t>      _head;      // next slot to pop; the consumer writes it
+    char                _pad1[64];
+    atomic<size_t>      _tail;      // next slot to push; the producer writes it
+    char                _pad2[64];
+    atomic<bool>        _closed;    // the producer has finished
+    atomic<size_t>      _sleeping;  // threads waiting on _wake
+    mutex               _lock;
+    condition_variable  _wake;
+
+    template<typename F>
+    void    wait(F ready);
+    void    wake();
+};
+
+// Constructor.  size must be a power of two.
+template<typename T>
+SpscRing<T>::SpscRing(size_t size) : _items(size), _mask{size - 1}, _head{0},
+_pad1{}, _tail{0}, _pad2{}, _closed{false}, _sleeping{0}, _lock{}, _wake{} {
+}
+
+// Move item into the ring.  Returns false if it is full.
+template<typename T>
+bool SpscRing<T>::push(T& item) {
+    size_t tail = _tail.load(memory_order_relaxed);
+
+    if (tail - _head.load(memory_order_acquire) > _mask) {
+        return false;
+    }
+
+    _items[tail & _mask] = move(item);
+    _tail.store(tail + 1, memory_order_seq_cst);
+    wake();
+    return true;
+}
+
+// Move the oldest item out of the ring.  Returns false if it is empty.
+template<typename T>
+bool SpscRing<T>::pop(T& item) {
+    size_t head = _head.load(memory_order_relaxed);
+
+    if (head == _tail.load(memory_order_acquire)) {
+        return false;
+    }
+
+    item = move(_items[head & _mask]);
+    _head.store(head + 1, memory_order_seq_cst);
+    wake();
+    return true;
+}
+
+// Wait until the producer can push.
+template<typename T>
+void SpscRing<T>::wait_for_room() {
+    wait([this] {
+        return _tail.load(memory_order_relaxed) -
+            _head.load(memory_order_seq_cst) <= _mask;
+    });
+}
+
+// Wait until the consumer can pop or the ring is closed.
+template<typename T>
+void SpscRing<T>::wait_for_item() {
+    wait([this] {
+        return _head.load(memory_order_relaxed) !=
+            _tail.load(memory_order_seq_cst) ||
+            _closed.load(memory_order_seq_cst);
+    });
+}
+
+// Let the consumer know nothing more will be pushed.
+template<typename T>
+void SpscRing<T>::close() {
+    _closed.store(true, memory_order_seq_cst);
+    wake();
+}
+
+template<typename T>
+bool SpscRing<T>::closed() const {
+    return _closed.load(memory_order_acquire);
+}
+
+// Spin until ready() and then, unless there is only one CPU to spin on, go
+// to sleep until it is.  _sleeping is raised before ready() is checked under
+// the lock and the other side moves its index before looking at _sleeping,
+// so either we see the move or it sees us and wakes us.
+template<typename T>
+template<typename F>
+void SpscRing<T>::wait(F ready) {
+    static const size_t spins = thread::hardware_concurrency() > 1 ?
+        SPINS : 0;
+
+    for (size_t i = 0; i < spins; i++) {
+        if (ready()) {
+            return;
+        }
+    }
+
+    _sleeping.fetch_add(1, memory_order_seq_cst);
+    {
+        unique_lock<mutex> guard(_lock);
+        _wake.wait(guard, ready);
+    }
+    _sleeping.fetch_sub(1, memory_order_relaxed);
+}
+
+// Wake whoever is waiting for the index just moved.
+template<typename T>
+void SpscRing<T>::wake() {
+    if (_sleeping.load(memory_order_seq_cst) == 0) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(_lock);
+    }
+    _wake.notify_all();
+}
+
+// How many items are waiting.
+template<typename T>
+size_t SpscRing<T>::depth() const {
+    return _tail.load(memory_order_acquire) - _head.load(memory_order_acquire);
+}
+
+// Evaluates lines in three stages, each on its own thread: reading input and
+// splitting it into lines, evaluating them and writing the results.  Batches
+// of lines go from one stage to the next through SpscRings so I/O overlaps
+// with evaluation.  Each stage keeps track of how much of its time it spent
+// working rather than waiting on its neighbours.
+class Pipeline {
+public:
+    Pipeline();
+    void run(istream& in, ostream& out);
+    void dump(ostream& out) const;
+private:
+    static const size_t BATCHSIZE = 1024;   // lines in a batch
+    static const size_t BLOCKSIZE = 1 << 20; // bytes read at once
+    static const size_t SLOTS = 64;         // batches in each ring
+
+    // Time a stage spent busy and waiting and how deep its output ring was.
+    struct Stage {
+        chrono::nanoseconds busy;
+        chrono::nanoseconds idle;
+        size_t              batches;
+        size_t              depth;      // sum of output depth at each push
+    };
+
+    SpscRing<Batch>     _lines;
+    SpscRing<Batch>     _results;
+    Stage               _stages[3];
+
+    void    read(istream& in);
+    void    evaluate();
+    void    write(ostream& out);
+    void    send(SpscRing<Batch>& ring, Batch& batch, Stage& stage);
+    bool    receive(SpscRing<Batch>& ring, Batch& batch, Stage& stage);
+};
+
+// Constructor
+Pipeline::Pipeline() : _lines{SLOTS}, _results{SLOTS}, _stages{} {
+}
+
+// Push a batch onto ring, waiting for room if need be.
+void Pipeline::send(SpscRing<Batch>& ring, Batch& batch, Stage& stage) {
+    auto start = chrono::steady_clock::now();
+    while (!ring.push(batch)) {
+        ring.wait_for_room();
+    }
+    stage.idle += chrono::steady_clock::now() - start;
+    stage.batches++;
+    stage.depth += ring.depth();
+}
+
+// Pop a batch from ring, waiting for one if need be.  Returns false once the
+// ring is empty and closed.
+bool Pipeline::receive(SpscRing<Batch>& ring, Batch& batch, Stage& stage) {
+    auto start = chrono::steady_clock::now();
+    bool received;
+    while (!(received = ring.pop(batch))) {
+        if (ring.closed()) {
+            received = ring.pop(batch); // it may have been pushed just before
+            break;
+        }
+        ring.wait_for_item();
+    }
+    stage.idle += chrono::steady_clock::now() - start;
+    return received;
+}
+
+// Read input in large blocks and split it into batches of lines.
+void Pipeline::read(istream& in) {
+    Stage& stage = _stages[0];
+    vector<char> block(BLOCKSIZE);
+    Batch batch{0, {}, {}};
+    string partial;     // a line split across two blocks
+    auto start = chrono::steady_clock::now();
+
+    while (in) {
+        in.read(block.data(), block.size());
+        size_t length = static_cast<size_t>(in.gcount());
+        size_t begin = 0;
+
+        for (size_t i = 0; i < length; i++) {
+            if (block[i] != '\n') {
+                continue;
+            }
+            partial.append(&block[begin], i - begin);
+            batch.lines.push_back(move(partial));
+            partial.clear();
+            begin = i + 1;
+
+            if (batch.lines.size() == BATCHSIZE) {
+                stage.busy += chrono::steady_clock::now() - start;
+                send(_lines, batch, stage);
+                batch = Batch{0, {}, {}};
+                start = chrono::steady_clock::now();
+            }
+        }
+        partial.append(&block[begin], length - begin);
+    }
+
+    if (!partial.empty()) {
+        batch.lines.push_back(move(partial));
+    }
+    stage.busy += chrono::steady_clock::now() - start;
+    if (!batch.lines.empty()) {
+        send(_lines, batch, stage);
+    }
+    _lines.close();
+}
+
+// Evaluate each batch of lines.
+void Pipeline::evaluate() {
+    Stage& stage = _stages[1];
+    Batch batch{0, {}, {}};
+
+    while (receive(_lines, batch, stage)) {
+        auto start = chrono::steady_clock::now();
+        batch.output.clear();
+        for (auto& text : batch.lines) {
+            ::evaluate(text, batch.output);
+        }
+        stage.busy += chrono::steady_clock::now() - start;
+        send(_results, batch, stage);
+    }
+    _results.close();
+}
+
+// Write out the results of each batch.
+void Pipeline::write(ostream& out) {
+    Stage& stage = _stages[2];
+    Batch batch{0, {}, {}};
+
+    while (receive(_results, batch, stage)) {
+        auto start = chrono::steady_clock::now();
+        out.write(batch.output.data(), batch.output.length());
+        stage.busy += chrono::steady_clock::now() - start;
+        stage.batches++;
+    }
+    auto start = chrono::steady_clock::now();
+    out.flush();
+    stage.busy += chrono::steady_clock::now() - start;
+}
+
+// Evaluate all of in, writing one line of output per line of input to out.
+void Pipeline::run(istream& in, ostream& out) {
+    thread reader(&Pipeline::read, this, ref(in));
+    thread evaluator(&Pipeline::evaluate, this);
+
+    write(out);
+
+    reader.join();
+    evaluator.join();
+}
+
+// Print how busy each stage was.  The stage with the highest share of busy
+// time is the bottleneck.
+void Pipeline::dump(ostream& out) const {
+    const char* names[] = { "read", "evaluate", "write" };
+
+    for (size_t i = 0; i < 3; i++) {
+        const Stage& stage = _stages[i];
+        double busy = chrono::duration<double>(stage.busy).count();
+        double total = busy + chrono::duration<double>(stage.idle).count();
+
+        out << "pipeline: " << names[i] << " " << fixed << setprecision(1)
+            << (total > 0 ? 100.0 * busy / total : 0.0) << "% busy, "
+            << setprecision(3) << busy << "s busy of " << total << "s, "
+            << stage.batches << " batches";
+        if (i < 2) {
+            out << ", average queue depth " << setprecision(1)
+                << (stage.batches ? 1.0 * stage.depth / stage.batches : 0.0);
+        }
+        out << endl;
+    }
+}
+
+// Apply edits read from in to a line, writing its new value after each.  An
+// edit is OFFSET LENGTH TEXT, meaning replace LENGTH bytes starting at OFFSET
+// with TEXT, which is the rest of the line after one space.
+void incremental(istream& in, ostream& out) {
+    IncrementalCalculator calculator;
+    string line;
+
+    while (getline(in, line)) {
+        istringstream edit(line);
+        size_t offset, length;
+        if (!(edit >> offset >> length)) {
+            out << "Error parsing edit" << endl;
+            continue;
+        }
+        string text;
+        edit.get();
+        getline(edit, text);
+
+        try {
+            out << calculator.edit(offset, length, text) << endl;
+        }
+        catch(const char* error) {
+            out << error << endl;
+        }
+    }
+}
+
+// What a stream of input looks like, for --profile-workload: how long and how
+// spaced out its lines are, what tokens they are made of, how deep and how
+// big their expressions are and which shapes of expression turn up most.
+class WorkloadProfile {
+public:
+    WorkloadProfile();
+    void    add(string& text);
+    void    dump(ostream& out) const;
+private:
+    static const size_t TYPES = static_cast<size_t>(TOKENTYPE::SEMI) + 1;
+    static const size_t SHAPELENGTH = 64;   // longer shapes are cut short
+    static const size_t SHAPES = 1 << 16;   // distinct shapes counted
+    static const size_t TOP = 10;           // and reported
+
+    size_t              _lines;
+    size_t              _unlexable;
+    size_t              _expressions;
+    size_t              _unparsed;
+    size_t              _totals[TYPES];
+    size_t              _other;             // expressions of uncounted shape
+    Histogram           _tokens[TYPES];     // per line
+    Histogram           _length;
+    Histogram           _whitespace;        // percent of each line
+    Histogram           _digits;            // per literal
+    Histogram           _depth;             // per expression
+    Histogram           _nodes;             // per expression
+    map<string, size_t> _shapes;
+    vector<Token>       _buffer;
+    Tree                _tree;
+
+    void    shape(const string& text);
+};
+
+const size_t WorkloadProfile::TOP;
+
+// Constructor
+WorkloadProfile::WorkloadProfile() : _lines{0}, _unlexable{0},
+_expressions{0}, _unparsed{0}, _totals{}, _other{0}, _tokens{}, _length{},
+_whitespace{}, _digits{}, _depth{}, _nodes{}, _shapes{}, _buffer{}, _tree{} {
+}
+
+// Count one line.  The tokens are lexed once and the parser given them from
+// the buffer.
+void WorkloadProfile::add(string& text) {
+    _lines++;
+    _length.add(text.length());
+    if (!text.empty()) {
+        size_t spaces = static_cast<size_t>(count_if(text.begin(), text.end(),
+            [](char c) { return isspace(static_cast<unsigned char>(c)); }));
+        _whitespace.add(spaces * 100 / text.length());
+    }
+
+    size_t counts[TYPES] = {};
+    string form;
+    size_t depth = 0;
+    size_t deepest = 0;
+    Lexer lexer(text);
+    _buffer.clear();
+    try {
+        while (true) {
+            Token token = lexer.get_next_token();
+            if (token.type == TOKENTYPE::ENDOFFILE) {
+                break;
+            }
+            _buffer.push_back(token);
+            counts[static_cast<size_t>(token.type)]++;
+
+            switch (token.type) {
+                case TOKENTYPE::INTEGER:
+                    _digits.add(lexer.position() - lexer.start());
+                    form += 'n';
+                    break;
+                case TOKENTYPE::LPAREN:
+                    deepest = max(deepest, ++depth);
+                    form += '(';
+                    break;
+                case TOKENTYPE::RPAREN:
+                    depth -= depth > 0;
+                    form += ')';
+                    break;
+                case TOKENTYPE::SEMI:
+                    _depth.add(deepest);
+                    depth = deepest = 0;
+                    shape(form);
+                    form.clear();
+                    break;
+                default:
+                    form += "?+-*/"[static_cast<size_t>(token.type) - 1];
+                    break;
+            }
+        }
+    }
+    catch(const char*) {
+        _unlexable++;
+        return;
+    }
+    _depth.add(deepest);
+    shape(form);
+
+    for (size_t i = 1; i < TYPES; i++) {
+        _tokens[i].add(counts[i]);
+        _totals[i] += counts[i];
+    }
+
+    TokenStream stream(_buffer.data(), _buffer.size());
+    Parser parser(stream, _tree);
+    parser.next();
+    do {
+        _expressions++;
+        try {
+            _tree.clear();
+            parser.parse();
+            _nodes.add(_tree.size());
+        }
+        catch(const char*) {
+            _unparsed++;
+        }
+    } while (parser.next());
+}
+
+// Count the shape of one expression, its tokens with every literal as n.
+void WorkloadProfile::shape(const string& text) {
+    string key(text, 0, SHAPELENGTH);
+    if (text.length() > SHAPELENGTH) {
+        key += "...";
+    }
+
+    auto found = _shapes.find(key);
+    if (found != _shapes.end()) {
+        found->second++;
+    } else if (_shapes.size() < SHAPES) {
+        _shapes.emplace(key, 1);
+    } else {
+        _other++;
+    }
+}
+
+// Print the report.
+void WorkloadProfile::dump(ostream& out) const {
+    auto spread = [&out](const Histogram& h, const char* unit) {
+        out << " p50 " << h.percentile(0.5) << unit << ", p90 "
+            << h.percentile(0.9) << unit << ", p99 " << h.percentile(0.99)
+            << unit << ", p999 " << h.percentile(0.999) << unit << endl;
+    };
+
+    out << "profile: " << _lines << " lines, " << _unlexable
+        << " unlexable, " << _expressions << " expressions, " << _unparsed
+        << " unparsed" << endl;
+    out << "profile: length";
+    spread(_length, "");
+    out << "profile: whitespace";
+    spread(_whitespace, "%");
+
+    size_t tokens = 0;
+    for (size_t i = 1; i < TYPES; i++) {
+        tokens += _totals[i];
+    }
+    for (size_t i = 1; i < TYPES; i++) {
+        out << "profile: " << static_cast<TOKENTYPE>(i) << " " << fixed
+            << setprecision(1) << (tokens ? 100.0 * _totals[i] / tokens : 0.0)
+            << "% of tokens, per line";
+        spread(_tokens[i], "");
+    }
+
+    out << "profile: digits per literal";
+    spread(_digits, "");
+    out << "profile: depth per expression";
+    spread(_depth, "");
+    out << "profile: nodes per expression";
+    spread(_nodes, "");
+
+    vector<pair<size_t, const string*>> shapes;
+    size_t total = _other;
+    for (auto& shape : _shapes) {
+        shapes.emplace_back(shape.second, &shape.first);
+        total += shape.second;
+    }
+    size_t top = min(TOP, shapes.size());
+    partial_sort(shapes.begin(), shapes.begin() + static_cast<long>(top),
+        shapes.end(), [](const pair<size_t, const string*>& a,
+        const pair<size_t, const string*>& b) {
+            return a.first > b.first || (a.first == b.first &&
+                *a.second < *b.second);
+        });
+    out << "profile: " << _shapes.size() << (_other ? "+" : "")
+        << " shapes, the commonest" << endl;
+    for (size_t i = 0; i < top; i++) {
+        out << "profile: " << setw(10) << shapes[i].first << " ("
+            << setw(5) << 100.0 * shapes[i].first / total << "%) "
+            << *shapes[i].second << endl;
+    }
+}
+
+// Evaluates a tree over and over, timing every node, for :explain.  What
+// reading the clock costs is taken off each node's time, as is what timing
+// each node inside it cost, which is more as it reads the clock twice.
+// Values of groups are looked up in the memo if there is one and the pool
+// would not evaluate them, as they would be in earnest.
+class Explain {
+public:
+    Explain(const Tree& tree, bool large, bool parsed);
+    void    run(size_t times);
+    void    dump(ostream& out) const;
+private:
+    static const size_t SMALL = 64;     // trees shown in full
+    static const size_t TEXT = 60;      // characters of each node shown
+
+    struct Figures {
+        uint64_t    runs;
+        uint64_t    hits;   // found in the memo
+        uint64_t    ns;
+    };
+
+    const Tree&         _tree;
+    bool                _large;         // would be evaluated on the pool
+    bool                _parsed;        // would go through Parser at all
+    size_t              _runs;
+    vector<Figures>     _figures;
+    uint64_t            _timings;       // nodes timed so far
+    uint64_t            _overhead;      // nanoseconds to read the clock
+    uint64_t            _nested;        // and to time a node
+
+    long        evaluate(size_t n);
+    const char* backend(size_t n) const;
+    void        dump(ostream& out, size_t n, size_t depth) const;
+    void        text(string& out, size_t n) const;
+};
+
+// Constructor
+Explain::Explain(const Tree& tree, bool large, bool parsed) : _tree{tree},
+_large{large}, _parsed{parsed}, _runs{0},
+_figures(tree.size(), Figures{0, 0, 0}), _timings{0}, _overhead{UINT64_MAX},
+_nested{UINT64_MAX} {
+    for (size_t i = 0; i < 1000; i++) {
+        auto t = chrono::steady_clock::now();
+        _overhead = min(_overhead, static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - t).count()));
+    }
+
+    // The first node made is always a literal, which takes next to nothing
+    // to evaluate, so timing it from outside times the timing.
+    _nested = 0;
+    uint64_t nested = UINT64_MAX;
+    for (size_t i = 0; i < 1000; i++) {
+        auto t = chrono::steady_clock::now();
+        evaluate(0);
+        nested = min(nested, static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - t).count()));
+    }
+    _nested = nested > _overhead ? nested - _overhead : 0;
+    _figures[0] = Figures{0, 0, 0};
+}
+
+// Evaluate the whole tree times more times.
+void Explain::run(size_t times) {
+    for (size_t i = 0; i < times; i++) {
+        evaluate(_tree.root());
+    }
+    _runs += times;
+}
+
+// As Tree::evaluate.
+long Explain::evaluate(size_t n) {
+    const AST& node = _tree.node(n);
+    Figures& figures = _figures[n];
+    uint64_t timings = _timings;
+    auto start = chrono::steady_clock::now();
+
+    long result = node.value;
+    if (node.type != TOKENTYPE::INTEGER) {
+        bool memoize = Tree::memo && node.group &&
+            !(_large && node.size >= WorkStealingPool::CUTOFF);
+        if (memoize && Tree::memo->find(_tree.key(n), result)) {
+            figures.hits++;
+        } else {
+            result = evaluate(_tree.operand(node.first).node);
+            for (size_t i = node.first + 1; i < node.first + node.count;
+            i++) {
+                result = apply(_tree.operand(i).op, result,
+                    evaluate(_tree.operand(i).node));
+            }
+            if (memoize) {
+                Tree::memo->insert(_tree.key(n), result);
+            }
+        }
+    }
+
+    uint64_t ns = static_cast<uint64_t>(chrono::duration_cast<
+        chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    uint64_t overhead = _overhead + (_timings++ - timings) * _nested;
+    figures.ns += ns > overhead ? ns - overhead : 0;
+    figures.runs++;
+    return result;
+}
+
+// What would evaluate node n in earnest, most of the time: Interpreter if
+// the line would never be parsed into a tree, the pool for its big subtrees,
+// and otherwise the memo or the tree.
+const char* Explain::backend(size_t n) const {
+    const Figures& figures = _figures[n];
+    if (!_parsed) {
+        return "interp";
+    } else if (_large && _tree.node(n).size >= WorkStealingPool::CUTOFF) {
+        return "pool";
+    } else if (figures.hits * 2 > figures.runs) {
+        return "memo";
+    }
+    return "tree";
+}
+
+// Print the tree with how many times each node ran and how long it took
+// each time, in all and less its operands.  Big trees only show the nodes
+// which took at least 1% of the time.
+void Explain::dump(ostream& out) const {
+    size_t n = _tree.root();
+    out << "explain: " << _runs << " runs of " << _tree.size() << " nodes, "
+        << (_runs ? _figures[n].ns / _runs : 0) << "ns per run, timing "
+        << _nested << "ns per node; expressions like this run on the "
+        << (_large ? "pool" : _parsed ? "tree" : "interpreter") << endl;
+    out << "      ns/run    self   share    runs    hits  backend  node"
+        << endl;
+    dump(out, n, 0);
+}
+
+// Print node n, indented by depth, and those of its operands worth showing.
+void Explain::dump(ostream& out, size_t n, size_t depth) const {
+    const AST& node = _tree.node(n);
+    const Figures& figures = _figures[n];
+    uint64_t total = max<uint64_t>(_figures[_tree.root()].ns, 1);
+
+    uint64_t operands = 0;
+    if (node.type != TOKENTYPE::INTEGER) {
+        for (size_t i = node.first; i < node.first + node.count; i++) {
+            operands += _figures[_tree.operand(i).node].ns;
+        }
+    }
+
+    string shown;
+    text(shown, n);
+    if (shown.length() > TEXT) {
+        shown.resize(TEXT - 3);
+        shown += "...";
+    }
+
+    uint64_t runs = max<uint64_t>(figures.runs, 1);
+    out << setw(12) << figures.ns / runs << setw(8)
+        << (figures.ns > operands ? figures.ns - operands : 0) / runs
+        << setw(7) << fixed << setprecision(1) << 100.0 * figures.ns / total
+        << '%' << setw(8) << figures.runs << setw(8) << figures.hits << "  "
+        << left << setw(7) << backend(n) << right << "  "
+        << string(depth * 2, ' ') << shown << endl;
+
+    if (node.type == TOKENTYPE::INTEGER) {
+        return;
+    }
+    size_t hidden = 0;
+    for (size_t i = node.first; i < node.first + node.count; i++) {
+        size_t child = _tree.operand(i).node;
+        if (_tree.size() <= SMALL || _figures[child].ns * 100 >= total) {
+            dump(out, child, depth + 1);
+        } else {
+            hidden++;
+        }
+    }
+    if (hidden) {
+        out << string(55 + depth * 2 + 2, ' ') << "(" << hidden
+            << " more under 1%)" << endl;
+    }
+}
+
+// Append the text of the subtree at node n to out, stopping not long after
+// there is enough to show.
+void Explain::text(string& out, size_t n) const {
+    const AST& node = _tree.node(n);
+
+    if (node.group) {
+        out += '(';
+    }
+    if (node.type == TOKENTYPE::INTEGER) {
+        out += to_string(node.value);
+    } else {
+        for (size_t i = node.first; i < node.first + node.count &&
+        out.length() <= TEXT; i++) {
+            if (i > node.first) {
+                out += "?+-*/"[static_cast<size_t>(_tree.operand(i).op) - 1];
+            }
+            text(out, _tree.operand(i).node);
+        }
+    }
+    if (node.group) {
+        out += ')';
+    }
+}
+
+// :explain EXPRESSION in the REPL.  Each expression on the line is parsed
+// into a tree and evaluated EXPLAIN times, or as many as there is time for
+// in a second, and the tree printed with what each node took.  Which backend
+// would evaluate it is decided for the whole line, as calculate_each() does.
+const size_t EXPLAIN = 1000;
+
+void explain(string& text, ostream& out) {
+    static Tree tree;
+    bool trace = Lexer::trace;
+    Lexer::trace = false;
+
+    Lexer lexer(text);
+    Parser parser(lexer, tree);
+    bool large = parallel(text.length());
+    parser.next();
+    do {
+        try {
+            tree.clear();
+            parser.parse();
+            Explain explain(tree, large, large || Tree::memo);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < EXPLAIN && chrono::steady_clock::now() -
+            start < chrono::seconds(1); i++) {
+                explain.run(1);
+            }
+            explain.dump(out);
+        }
+        catch(const char* error) {
+            out << error << endl;
+        }
+    } while (parser.next());
+
+    Lexer::trace = trace;
+}
+
+// Where :bench puts results so the work is not optimized away.
+volatile long bench_sink;
+
+// Time op, which lexes, parses and evaluates a line one way, n times after
+// warming up with a tenth as many, and print the mean time it took with a
+// 95% confidence interval.  The runs are split into ROUNDS rounds and the
+// interval comes from the spread of their means.
+template<typename F>
+void bench(const char* backend, size_t n, F op, ostream& out) {
+    static const size_t ROUNDS = 10;
+    // Student's t for a two-sided 95% interval, by degrees of freedom.
+    static const double T95[ROUNDS] = {0.0, 12.706, 4.303, 3.182, 2.776,
+        2.571, 2.447, 2.365, 2.306, 2.262};
+
+    for (size_t i = 0; i < max<size_t>(n / 10, 1); i++) {
+        bench_sink = op();
+    }
+
+    size_t rounds = min(n, ROUNDS);
+    double means[ROUNDS];
+    double mean = 0.0;
+    for (size_t r = 0; r < rounds; r++) {
+        size_t runs = n / rounds + (r < n % rounds);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < runs; i++) {
+            bench_sink = op();
+        }
+        means[r] = chrono::duration<double, nano>(
+            chrono::steady_clock::now() - start).count() / runs;
+        mean += means[r] / rounds;
+    }
+
+    double variance = 0.0;
+    for (size_t r = 0; r < rounds; r++) {
+        variance += (means[r] - mean) * (means[r] - mean);
+    }
+    out << "bench: " << left << setw(12) << backend << right << fixed
+        << setprecision(1) << setw(12) << mean << " ns/op";
+    if (rounds > 1) {
+        double interval = T95[rounds - 1] *
+            sqrt(variance / (rounds - 1) / rounds);
+        out << " +/- " << interval << " (95%)";
+    }
+    out << endl;
+}
+
+// :bench N EXPRESSION in the REPL.  The whole line is lexed, parsed and
+// evaluated N times by each backend there is, with the token trace off.  N
+// is at most BENCH.
+const size_t BENCH = 1000000000;
+
+void bench(string& text, ostream& out) {
+    static Tree tree;
+    size_t space = text.find(' ');
+    unsigned long n = 0;
+    if (space == string::npos ||
+    !parse_number(text.substr(0, space).c_str(), BENCH, n) || n == 0) {
+        out << "Usage: :bench N EXPRESSION, N from 1 to " << BENCH << endl;
+        return;
+    }
+    text.erase(0, space + 1);
+
+    bool trace = Lexer::trace;
+    Lexer::trace = false;
+
+    // Check it evaluates, without filling the memo before it is timed.
+    Memo* memo = Tree::memo;
+    Tree::memo = nullptr;
+    const char* failure = nullptr;
+    calculate_each(text, [&failure](long, const char* error) {
+        if (error && !failure) {
+            failure = error;
+        }
+    });
+    Tree::memo = memo;
+    if (failure) {
+        out << failure << endl;
+        Lexer::trace = trace;
+        return;
+    }
+
+    out << "bench: " << n << " runs of " << text.length() << " bytes after "
+        << max<size_t>(n / 10, 1) << " to warm up" << endl;
+
+    bench("interpreter", n, [&text]() {
+        Lexer lexer(text);
+        Interpreter interpreter(lexer);
+        long sum = 0;
+        interpreter.next();
+        do {
+            sum += interpreter.expression();
+        } while (interpreter.next());
+        return sum;
+    }, out);
+
+    auto build = [&text](bool large) {
+        Lexer lexer(text);
+        Parser parser(lexer, tree);
+        long sum = 0;
+        parser.next();
+        do {
+            tree.clear();
+            parser.parse();
+            sum += large ? pool().evaluate(tree) : tree.evaluate(tree.root());
+        } while (parser.next());
+        return sum;
+    };
+    Tree::memo = nullptr;
+    bench("tree", n, [&build]() { return build(false); }, out);
+    if (memo) {
+        Tree::memo = memo;
+        bench("memo", n, [&build]() { return build(false); }, out);
+        Tree::memo = nullptr;
+    }
+    pool();     // start its threads before anything is timed
+    bench("pool", n, [&build]() { return build(true); }, out);
+    Tree::memo = memo;
+
+    Lexer::trace = trace;
+}
+
+// Open a listening socket.  An address with a / in it is the path of a Unix
+// socket, anything else is a TCP port on localhost.
+int listen_on(const string& address) {
+    int fd;
+
+    if (address.find('/') != string::npos) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.length() >= sizeof(addr.sun_path)) {
+            error("Socket path too long: " + address);
+        }
+        strcpy(addr.sun_path, address.c_str());
+        unlink(addr.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            error("Can't bind " + address + ": " + strerror(errno));
+        }
+    } else {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        char* end;
+        unsigned long port = strtoul(address.c_str(), &end, 10);
+        if (!isdigit(static_cast<unsigned char>(address[0])) || *end != '\0' ||
+        port == 0 || port > 65535) {
+            error("Bad address " + address +
+                ": wanted a port number or a socket path");
+        }
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            error("Can't bind " + address + ": " + strerror(errno));
+        }
+    }
+
+    if (::listen(fd, SOMAXCONN) < 0) {
+        error("Can't listen on " + address + ": " + strerror(errno));
+    }
+
+    return fd;
+}
+
+// The reason phrase for an HTTP status code.
+const char* reason(int status) {
+    switch(status) {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 413:
+            return "Content Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        default:
+            return "HTTP Version Not Supported";
+    }
+}
+
+// Answer one HTTP request, appending the response to output.  If status is
+// 200, body is a POST to /eval and the response has one line, the result or
+// the error, per line of it.
+void evaluate_http(int status, const string& body, bool close,
+string& output) {
+    static thread_local string results;
+    static thread_local string line;
+
+    results.clear();
+    if (status == 200) {
+        size_t begin = 0;
+        while (begin < body.length()) {
+            size_t newline = body.find('\n', begin);
+            if (newline == string::npos) {
+                newline = body.length();
+            }
+            size_t length = newline - begin;
+            if (length && body[newline - 1] == '\r') {
+                length--;
+            }
+            line.assign(body, begin, length);
+            evaluate(line, results);
+            begin = newline + 1;
+        }
+    } else {
+        count_error(STATUS::BAD_REQUEST);
+        results += reason(status);
+        results += '\n';
+    }
+
+    output += "HTTP/1.1 ";
+    output += to_string(status);
+    output += ' ';
+    output += reason(status);
+    output += "\r\nContent-Type: text/plain\r\nContent-Length: ";
+    output += to_string(results.length());
+    if (status == 405) {
+        output += "\r\nAllow: POST";
+    }
+    if (close) {
+        output += "\r\nConnection: close";
+    }
+    output += "\r\n\r\n";
+    output += results;
+}
+
+// Does the text from begin to end equal s?
+bool equals(const char* begin, const char* end, const char* s) {
+    size_t length = strlen(s);
+    return static_cast<size_t>(end - begin) == length &&
+        memcmp(begin, s, length) == 0;
+}
+
+// Or the same ignoring case, as header names and some values are.
+bool matches(const char* begin, const char* end, const char* s) {
+    size_t length = strlen(s);
+    return static_cast<size_t>(end - begin) == length &&
+        strncasecmp(begin, s, length) == 0;
+}
+
+// What the clients of a listening socket send.
+enum class PROTOCOL {
+    LINES,      // newline-delimited expressions
+    FRAMES,     // the binary protocol
+    HTTP,       // HTTP/1.1 POSTs to /eval
+    METRICS     // any HTTP request, answered with the metrics
+};
+
+// What each server worker has done, for --metrics.  Only the worker writes
+// its own, so plain loads and stores will do, and the padding keeps any two
+// workers off each other's cache lines.  Scrapes add them all up.
+struct WorkerMetrics {
+    // Upper bounds of the latency buckets, in nanoseconds.
+    static constexpr uint64_t BUCKETS[] = {1000, 2500, 5000, 10000, 25000,
+        50000, 100000, 250000, 500000, 1000000, 10000000, 100000000};
+    static const size_t NBUCKETS = sizeof(BUCKETS) / sizeof(BUCKETS[0]);
+
+    // Kinds of error.  The first few are STATUS values, less one.
+    enum KIND {
+        PARSE,
+        DIVISION_BY_ZERO,
+        BAD_REQUEST,
+        TOO_LARGE,      // an integer which won't fit in a long
+        KINDS
+    };
+
+    char                _pad1[64];
+    atomic<uint64_t>    requests;
+    atomic<uint64_t>    errors[KINDS];
+    atomic<uint64_t>    latency[NBUCKETS + 1];  // the last is the overflow
+    atomic<uint64_t>    latency_ns;
+    atomic<uint64_t>    busy_ns;
+    char                _pad2[64];
+
+    WorkerMetrics();
+    void    request(uint64_t ns);
+
+    static void bump(atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(memory_order_relaxed) + n,
+            memory_order_relaxed);
+    }
+
+    static thread_local WorkerMetrics* current;     // the caller's, if any
+};
+
+constexpr uint64_t WorkerMetrics::BUCKETS[];
+thread_local WorkerMetrics* WorkerMetrics::current = nullptr;
+
+// Constructor
+WorkerMetrics::WorkerMetrics() : _pad1{}, requests{0}, errors{}, latency{},
+latency_ns{0}, busy_ns{0}, _pad2{} {
+}
+
+// Count a request which took ns to answer.
+void WorkerMetrics::request(uint64_t ns) {
+    size_t bucket = 0;
+    while (bucket < NBUCKETS && ns > BUCKETS[bucket]) {
+        bucket++;
+    }
+    bump(requests);
+    bump(latency[bucket]);
+    bump(latency_ns, ns);
+}
+
+// Count an error against the calling worker.  Anyone else's are not counted.
+void count_error(STATUS status) {
+    if (WorkerMetrics::current) {
+        WorkerMetrics::bump(
+            WorkerMetrics::current->errors[static_cast<size_t>(status) - 1]);
+    }
+}
+
+void count_error(const char* error) {
+    if (WorkerMetrics::current == nullptr) {
+        return;
+    } else if (strcmp(error, "Integer too large") == 0) {
+        WorkerMetrics::bump(
+            WorkerMetrics::current->errors[WorkerMetrics::TOO_LARGE]);
+    } else {
+        count_error(status_of(error));
+    }
+}
+
+// Serves newline-delimited expressions over sockets.  One thread runs an
+// edge-triggered epoll loop which does all the reading and writing; complete
+// lines are handed to a pool of worker threads for evaluation and the
+// results come back to the loop to be written to the connection they came
+// from.  A connection has at most one batch of lines out with the workers at
+// a time so its results always go back in the order the lines came in.
+// Other listeners take frames of the binary protocol, or HTTP requests,
+// instead of lines.
+class Server {
+public:
+    Server(size_t workers);
+    ~Server();
+    void listen(const string& address, PROTOCOL protocol = PROTOCOL::LINES);
+    void run();
+private:
+    static const size_t READSIZE = 1 << 16;
+    static const size_t MAXLINE = 1 << 24;  // longest line a client may send
+    static const size_t MAXHEADER = 1 << 16;    // and HTTP header
+    static const size_t MAXINPUT = 2 * MAXLINE; // read no more than this
+    static const size_t MAXOUTPUT = MAXLINE;    // ahead, nor while this much
+                                                // is waiting to be written
+    static const size_t MAXBATCH = 1 << 20;     // input sent to a worker at
+                                                // once, unless one line is
+                                                // longer
+
+    // A client connection, or a listening socket.
+    struct Connection {
+        int     fd;
+        bool    listener;
+        PROTOCOL    protocol;
+        string      input;      // received but not yet sent to a worker
+        string      output;     // results not yet written
+        size_t      written;    // how much of output has been written
+        bool        busy;       // a batch is out with the workers
+        bool        eof;        // the client has finished sending
+        bool        dead;       // to be dropped once the workers are done
+        bool        close;      // HTTP: the last request in batch says so
+        bool        stalled;    // stopped reading until there is room
+        vector<int> status;     // HTTP: of each request in batch
+        Batch       batch;
+    };
+
+    int                                 _epoll;
+    int                                 _wakeup;    // eventfd for the workers
+    map<int, unique_ptr<Connection>>    _connections;
+    vector<thread>                      _workers;
+    vector<unique_ptr<WorkerMetrics>>   _metrics;   // one for each worker
+    mutex                               _lock;
+    condition_variable                  _work_ready;
+    deque<Connection*>                  _work;
+    deque<Connection*>                  _done;
+    vector<int>                         _closed;    // fds to close after
+                                                    // this round of events
+    vector<Connection*>                 _starved;   // listeners which ran
+                                                    // out of descriptors
+    bool                                _stop;
+
+    void    accept(Connection* listener);
+    void    receive(Connection* c);
+    void    dispatch(Connection* c);
+    void    dispatch_frames(Connection* c);
+    void    dispatch_http(Connection* c);
+    void    request(Connection* c, int status, size_t begin, size_t length);
+    void    submit(Connection* c);
+    void    flush(Connection* c);
+    void    complete();
+    void    finish(Connection* c);
+    void    resume(Connection* c);
+    void    drop(Connection* c);
+    void    sweep();
+    void    scrape(string& output);
+    void    work(WorkerMetrics* metrics);
+};
+
+// Constructor
+Server::Server(size_t workers) : _epoll{-1}, _wakeup{-1}, _connections{},
+_workers{}, _metrics{}, _lock{}, _work_ready{}, _work{}, _done{},
+_closed{}, _starved{}, _stop{false} {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_epoll < 0 || _wakeup < 0) {
+        error(string("Can't set up event loop: ") + strerror(errno));
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = nullptr;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &event);
+
+    // Thousands of connections need thousands of descriptors.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t i = 0; i < workers; i++) {
+        _metrics.emplace_back(new WorkerMetrics);
+    }
+    for (size_t i = 0; i < workers; i++) {
+        _workers.emplace_back(&Server::work, this, _metrics[i].get());
+    }
+}
+
+// Destructor
+Server::~Server() {
+    {
+        lock_guard<mutex> guard(_lock);
+        _stop = true;
+    }
+    _work_ready.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+    for (auto& connection : _connections) {
+        ::close(connection.first);
+    }
+    ::close(_wakeup);
+    ::close(_epoll);
+}
+
+// Accept connections on address as well.
+void Server::listen(const string& address, PROTOCOL protocol) {
+    int fd = listen_on(address);
+    Connection* c = new Connection{fd, true, protocol, {}, {}, 0, false, false,
+        false, false, false, {}, Batch{0, {}, {}}};
+    _connections[fd].reset(c);
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = c;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+// The event loop.  It never returns.
+void Server::run() {
+    vector<epoll_event> events(1024);
+
+    while (true) {
+        int n = epoll_wait(_epoll, events.data(),
+            static_cast<int>(events.size()), -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error(string("epoll_wait failed: ") + strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection* c = static_cast<Connection*>(events[i].data.ptr);
+            if (c == nullptr) {
+                complete();
+            } else if (c->listener) {
+                accept(c);
+            } else {
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                EPOLLERR)) {
+                    receive(c);
+                }
+                if (!c->dead && (events[i].events & EPOLLOUT)) {
+                    flush(c);
+                    resume(c);
+                }
+                finish(c);
+            }
+        }
+        sweep();
+    }
+}
+
+// Accept every connection waiting on listener.
+void Server::accept(Connection* listener) {
+    while (true) {
+        int fd = accept4(listener->fd, nullptr, nullptr,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                // There will be no new edge for what is already waiting, so
+                // try again once some connections have closed.
+                if (find(_starved.begin(), _starved.end(), listener) ==
+                _starved.end()) {
+                    _starved.push_back(listener);
+                }
+            }
+            return;
+        }
+
+        Connection* c = new Connection{fd, false, listener->protocol, {}, {},
+            0, false, false, false, false, false, {}, Batch{0, {}, {}}};
+        _connections[fd].reset(c);
+
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = c;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+// Read everything the client has sent so far.  As the loop is edge-triggered
+// it has to keep going until the socket runs dry, unless the connection has
+// so much waiting to be evaluated or written that it is left to stall until
+// there is room.
+void Server::receive(Connection* c) {
+    char buffer[READSIZE];
+
+    while (!c->eof && !c->dead) {
+        if (c->input.length() >= MAXINPUT || c->output.length() >= MAXOUTPUT) {
+            c->stalled = true;
+            break;
+        }
+        ssize_t n = read(c->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            c->input.append(buffer, static_cast<size_t>(n));
+        } else if (n == 0) {
+            c->eof = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            c->dead = true;
+        }
+    }
+
+    if (c->protocol == PROTOCOL::FRAMES) {
+        // Swap an oversized frame for an empty one, which is answered as a
+        // bad request in its turn, and hang up.
+        if (c->input.length() >= FRAMEHEADER &&
+        get_u32(c->input.data()) > MAXLINE) {
+            c->input.assign(FRAMEHEADER, '\0');
+            c->eof = true;
+        }
+    } else if (c->protocol == PROTOCOL::LINES &&
+    c->input.length() > MAXLINE && c->input.find('\n') == string::npos) {
+        c->output += "Line too long\n";
+        c->input.clear();
+        c->eof = true;
+    }
+
+    dispatch(c);
+}
+
+// Send the complete lines a connection has received to the workers, unless
+// it already has a batch out or too much output waiting.
+void Server::dispatch(Connection* c) {
+    if (c->busy || c->dead) {
+        return;
+    } else if (c->output.length() >= MAXOUTPUT) {
+        c->stalled = true;
+        return;
+    }
+
+    if (c->protocol == PROTOCOL::FRAMES) {
+        dispatch_frames(c);
+        return;
+    } else if (c->protocol == PROTOCOL::HTTP) {
+        dispatch_http(c);
+        return;
+    } else if (c->protocol == PROTOCOL::METRICS) {
+        // Answered here, without bothering the workers, once the whole
+        // request is in.  Whatever was asked for, the metrics are the answer.
+        if (c->input.find("\r\n\r\n") != string::npos || c->eof) {
+            scrape(c->output);
+            c->input.clear();
+            c->eof = true;
+            flush(c);
+        }
+        return;
+    }
+
+    size_t end = c->input.rfind('\n', MAXBATCH);
+    if (end == string::npos) {
+        end = c->input.find('\n');
+    }
+    if (end == string::npos) {
+        if (!c->eof || c->input.empty()) {
+            return;
+        }
+        end = c->input.length();    // last line with no newline
+    }
+
+    c->batch.lines.clear();
+    size_t begin = 0;
+    while (begin < end) {
+        size_t newline = c->input.find('\n', begin);
+        if (newline == string::npos || newline > end) {
+            newline = end;
+        }
+        size_t length = newline - begin;
+        if (length && c->input[newline - 1] == '\r') {
+            length--;
+        }
+        c->batch.lines.emplace_back(c->input, begin, length);
+        begin = newline + 1;
+    }
+    c->input.erase(0, min(end + 1, c->input.length()));
+    submit(c);
+}
+
+// Send the complete frames a connection has received to the workers.  A
+// frame cut short by the end of the connection is answered as a bad request.
+void Server::dispatch_frames(Connection* c) {
+    c->batch.lines.clear();
+    size_t begin = 0;
+    while (c->input.length() - begin >= FRAMEHEADER && begin < MAXBATCH) {
+        size_t length = get_u32(&c->input[begin]);
+        if (length > MAXLINE) {
+            c->batch.lines.emplace_back();
+            begin = c->input.length();
+            c->eof = true;
+            break;
+        }
+        if (c->input.length() - begin - FRAMEHEADER < length) {
+            break;
+        }
+        c->batch.lines.emplace_back(c->input, begin + FRAMEHEADER, length);
+        begin += FRAMEHEADER + length;
+    }
+    c->input.erase(0, begin);
+
+    // What is left is only known to be cut short if it was all looked at.
+    if (c->eof && begin < MAXBATCH && !c->input.empty()) {
+        c->batch.lines.emplace_back();
+        c->input.clear();
+    }
+
+    if (!c->batch.lines.empty()) {
+        submit(c);
+    }
+}
+
+// Send the complete HTTP requests a connection has received to the workers.
+// Requests are parsed where they lie in input; only the bodies of POSTs to
+// /eval are copied out, into strings which are kept from batch to batch.
+// Anything that leaves the request boundaries in doubt gets an error
+// response and the connection closed after it.
+void Server::dispatch_http(Connection* c) {
+    c->status.clear();
+    size_t begin = 0;
+
+    while (!c->close && begin < MAXBATCH) {
+        // Stray line breaks between requests are allowed.
+        while (begin < c->input.length() &&
+        (c->input[begin] == '\r' || c->input[begin] == '\n')) {
+            begin++;
+        }
+
+        size_t end = c->input.find("\r\n\r\n", begin);
+        if (end == string::npos) {
+            if (c->input.length() - begin > MAXHEADER) {
+                request(c, 431, begin, 0);
+                c->close = true;
+            } else if (c->eof && begin < c->input.length()) {
+                request(c, 400, begin, 0);
+                c->close = true;
+            }
+            break;
+        }
+
+        // The request line.
+        const char* line = c->input.data() + begin;
+        const char* last = c->input.data() + end;
+        const char* eol = search(line, last, "\r\n", "\r\n" + 2);
+        const char* space1 = find(line, eol, ' ');
+        const char* space2 = find(space1 + (space1 < eol), eol, ' ');
+        if (space2 == eol) {
+            request(c, 400, begin, 0);
+            c->close = true;
+            break;
+        }
+        bool keep = true;
+        if (equals(space2 + 1, eol, "HTTP/1.0")) {
+            keep = false;
+        } else if (!equals(space2 + 1, eol, "HTTP/1.1")) {
+            request(c, 505, begin, 0);
+            c->close = true;
+            break;
+        }
+
+        // The headers.
+        size_t length = 0;
+        int status = 200;
+        for (line = eol + 2; line < last && status == 200; line = eol + 2) {
+            eol = search(line, last, "\r\n", "\r\n" + 2);
+            const char* colon = find(line, eol, ':');
+            if (colon == eol) {
+                status = 400;
+                break;
+            }
+            const char* value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char* value_end = eol;
+            while (value_end > value &&
+            (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+
+            if (matches(line, colon, "Content-Length")) {
+                if (value == value_end) {
+                    status = 400;
+                }
+                length = 0;
+                for (const char* p = value; p < value_end; p++) {
+                    if (!isdigit(*p) || length > MAXLINE) {
+                        status = 400;
+                        break;
+                    }
+                    length = length * 10 + static_cast<size_t>(*p - '0');
+                }
+                if (status == 200 && length > MAXLINE) {
+                    status = 413;
+                }
+            } else if (matches(line, colon, "Transfer-Encoding")) {
+                status = 501;
+            } else if (matches(line, colon, "Connection")) {
+                if (matches(value, value_end, "close")) {
+                    keep = false;
+                } else if (matches(value, value_end, "keep-alive")) {
+                    keep = true;
+                }
+            }
+        }
+        if (status != 200) {
+            request(c, status, begin, 0);
+            c->close = true;
+            break;
+        }
+
+        // The body.
+        size_t body = end + 4;
+        if (c->input.length() - body < length) {
+            if (c->eof) {
+                request(c, 400, begin, 0);
+                c->close = true;
+            }
+            break;
+        }
+
+        const char* method = c->input.data() + begin;
+        if (!equals(space1 + 1, space2, "/eval")) {
+            status = 404;
+        } else if (!equals(method, space1, "POST")) {
+            status = 405;
+        }
+        request(c, status, body, status == 200 ? length : 0);
+        begin = body + length;
+        c->close = !keep;
+    }
+
+    if (c->close) {
+        c->input.clear();
+        c->eof = true;
+    } else {
+        c->input.erase(0, begin);
+    }
+
+    if (!c->status.empty()) {
+        submit(c);
+    }
+}
+
+// Add an HTTP request, whose body is length bytes of input from begin, to
+// a connection's batch.
+void Server::request(Connection* c, int status, size_t begin, size_t length) {
+    size_t n = c->status.size();
+    if (n < c->batch.lines.size()) {
+        c->batch.lines[n].assign(c->input, begin, length);
+    } else {
+        c->batch.lines.emplace_back(c->input, begin, length);
+    }
+    c->status.push_back(status);
+}
+
+// Hand a connection's batch to the workers.
+void Server::submit(Connection* c) {
+    c->batch.output.clear();
+    c->busy = true;
+
+    {
+        lock_guard<mutex> guard(_lock);
+        _work.push_back(c);
+    }
+    _work_ready.notify_one();
+}
+
+// Write as much pending output as the socket will take.
+void Server::flush(Connection* c) {
+    while (c->written < c->output.length()) {
+        ssize_t n = write(c->fd, c->output.data() + c->written,
+            c->output.length() - c->written);
+        if (n >= 0) {
+            c->written += static_cast<size_t>(n);
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->dead = true;
+            }
+            return;
+        }
+    }
+
+    c->output.clear();
+    c->written = 0;
+}
+
+// Collect batches the workers have finished with.
+void Server::complete() {
+    uint64_t count;
+    while (read(_wakeup, &count, sizeof(count)) > 0) {
+    }
+
+    deque<Connection*> done;
+    {
+        lock_guard<mutex> guard(_lock);
+        done.swap(_done);
+    }
+
+    for (auto c : done) {
+        c->busy = false;
+        if (!c->dead) {
+            c->output += c->batch.output;
+            flush(c);
+            dispatch(c);
+            resume(c);
+        }
+        finish(c);
+    }
+}
+
+// Drop a connection which is dead, or which has nothing more to say and
+// nothing more to be said to it.
+void Server::finish(Connection* c) {
+    if (c->dead || (c->eof && !c->busy && c->input.empty() &&
+    c->output.empty())) {
+        drop(c);
+    }
+}
+
+// Go back to reading from a connection which stalled, now there is room.
+void Server::resume(Connection* c) {
+    if (c->stalled && !c->dead && !c->busy &&
+    c->output.length() < MAXOUTPUT) {
+        c->stalled = false;
+        receive(c);
+    }
+}
+
+// Close a connection.  If a worker still has its batch this is put off until
+// the batch comes back.  Later events in the same round may still point at
+// the connection, so it is only freed, and its fd only closed for reuse, by
+// sweep().  An fd of -1 means it is already on its way out.
+void Server::drop(Connection* c) {
+    c->dead = true;
+    if (c->busy || c->fd < 0) {
+        return;
+    }
+
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+    _closed.push_back(c->fd);
+    c->fd = -1;
+}
+
+// Free the connections dropped this round and, if that gave back some
+// descriptors, accept whatever listeners had to leave waiting.
+void Server::sweep() {
+    if (_closed.empty()) {
+        return;
+    }
+    for (int fd : _closed) {
+        _connections.erase(fd);
+        ::close(fd);
+    }
+    _closed.clear();
+
+    vector<Connection*> starved;
+    starved.swap(_starved);
+    for (auto listener : starved) {
+        accept(listener);
+    }
+}
+
+// Append an HTTP response with the metrics, in the Prometheus text format,
+// to output.
+void Server::scrape(string& output) {
+    string body;
+    auto family = [&body](const char* name, const char* type,
+    const char* help) {
+        body += "# HELP ";
+        body += name;
+        body += ' ';
+        body += help;
+        body += "\n# TYPE ";
+        body += name;
+        body += ' ';
+        body += type;
+        body += '\n';
+    };
+    auto sample = [&body](const string& name, uint64_t value) {
+        body += name;
+        body += ' ';
+        body += to_string(value);
+        body += '\n';
+    };
+    auto seconds = [](uint64_t ns) {
+        ostringstream out;
+        out << ns / 1e9;
+        return out.str();
+    };
+
+    uint64_t requests = 0;
+    uint64_t errors[WorkerMetrics::KINDS] = {};
+    uint64_t latency[WorkerMetrics::NBUCKETS + 1] = {};
+    uint64_t latency_ns = 0;
+    for (auto& metrics : _metrics) {
+        requests += metrics->requests.load(memory_order_relaxed);
+        for (size_t i = 0; i < WorkerMetrics::KINDS; i++) {
+            errors[i] += metrics->errors[i].load(memory_order_relaxed);
+        }
+        for (size_t i = 0; i <= WorkerMetrics::NBUCKETS; i++) {
+            latency[i] += metrics->latency[i].load(memory_order_relaxed);
+        }
+        latency_ns += metrics->latency_ns.load(memory_order_relaxed);
+    }
+
+    family("calc6_requests_total", "counter",
+        "Lines, frames and HTTP requests answered.");
+    sample("calc6_requests_total", requests);
+
+    family("calc6_errors_total", "counter",
+        "Expressions and requests answered with an error.");
+    const char* kinds[] = {"parse", "division_by_zero", "bad_request",
+        "overflow"};
+    for (size_t i = 0; i < WorkerMetrics::KINDS; i++) {
+        sample(string("calc6_errors_total{kind=\"") + kinds[i] + "\"}",
+            errors[i]);
+    }
+
+    family("calc6_request_duration_seconds", "histogram",
+        "Time taken to evaluate a request.");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < WorkerMetrics::NBUCKETS; i++) {
+        cumulative += latency[i];
+        sample("calc6_request_duration_seconds_bucket{le=\"" +
+            seconds(WorkerMetrics::BUCKETS[i]) + "\"}", cumulative);
+    }
+    sample("calc6_request_duration_seconds_bucket{le=\"+Inf\"}", requests);
+    body += "calc6_request_duration_seconds_sum " + seconds(latency_ns) + '\n';
+    sample("calc6_request_duration_seconds_count", requests);
+
+    family("calc6_worker_busy_seconds_total", "counter",
+        "Time each worker has spent evaluating.");
+    for (size_t i = 0; i < _metrics.size(); i++) {
+        body += "calc6_worker_busy_seconds_total{worker=\"" + to_string(i) +
+            "\"} " + seconds(_metrics[i]->busy_ns.load(memory_order_relaxed)) +
+            '\n';
+    }
+
+    size_t waiting, finished;
+    {
+        lock_guard<mutex> guard(_lock);
+        waiting = _work.size();
+        finished = _done.size();
+    }
+    size_t clients = 0;
+    for (auto& connection : _connections) {
+        clients += !connection.second->listener;
+    }
+    family("calc6_queue_depth", "gauge",
+        "Batches waiting for a worker, or for the event loop.");
+    sample("calc6_queue_depth{queue=\"work\"}", waiting);
+    sample("calc6_queue_depth{queue=\"done\"}", finished);
+    family("calc6_connections", "gauge", "Open client connections.");
+    sample("calc6_connections", clients);
+
+    if (Tree::memo) {
+        family("calc6_memo_lookups_total", "counter",
+            "Subexpressions looked up in the memo table.");
+        sample("calc6_memo_lookups_total", Tree::memo->lookups());
+        family("calc6_memo_hits_total", "counter",
+            "Subexpressions found in the memo table.");
+        sample("calc6_memo_hits_total", Tree::memo->hits());
+    }
+
+    output += "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4"
+        "\r\nContent-Length: ";
+    output += to_string(body.length());
+    output += "\r\nConnection: close\r\n\r\n";
+    output += body;
+}
+
+// Body of the worker threads.  What each does is counted in metrics.
+void Server::work(WorkerMetrics* metrics) {
+    WorkerMetrics::current = metrics;
+
+    while (true) {
+        Connection* c;
+        {
+            unique_lock<mutex> guard(_lock);
+            _work_ready.wait(guard, [this] { return _stop || !_work.empty(); });
+            if (_stop) {
+                return;
+            }
+            c = _work.front();
+            _work.pop_front();
+        }
+
+        auto start = chrono::steady_clock::now();
+        auto then = start;
+        size_t n = c->protocol == PROTOCOL::HTTP ? c->status.size() :
+            c->batch.lines.size();
+        for (size_t i = 0; i < n; i++) {
+            string& text = c->batch.lines[i];
+            if (c->protocol == PROTOCOL::HTTP) {
+                evaluate_http(c->status[i], text,
+                    c->close && i + 1 == n, c->batch.output);
+            } else if (c->protocol == PROTOCOL::FRAMES) {
+                evaluate_frame(text, c->batch.output);
+            } else {
+                evaluate(text, c->batch.output);
+            }
+            auto now = chrono::steady_clock::now();
+            metrics->request(static_cast<uint64_t>(chrono::duration_cast<
+                chrono::nanoseconds>(now - then).count()));
+            then = now;
+        }
+        WorkerMetrics::bump(metrics->busy_ns, static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(then - start).count()));
+
+        {
+            lock_guard<mutex> guard(_lock);
+            _done.push_back(c);
+        }
+        uint64_t one = 1;
+        ssize_t written = write(_wakeup, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// Shared-memory rings for clients on the same host, modelled on io_uring.
+// The file holds a header and one Ring per server worker.  A client claims a
+// ring by putting its pid in owner, fills in entries of sq and publishes them
+// all at once by moving sq_tail; the worker evaluates everything published,
+// fills in entries of cq and publishes them by moving cq_tail.  Each side
+// spins for a while when it runs out of work and then sleeps on a futex,
+// setting its sleeping flag so the other side knows to wake it.  A client
+// must not have more than RING_ENTRIES requests outstanding (sq_tail -
+// cq_head), so the worker can never find cq full.
+const uint32_t RING_MAGIC = 0x636c6336;  // "calc6"
+const uint32_t RING_ENTRIES = 256;
+const uint32_t RING_ANY = UINT32_MAX;       // whichever ring is free
+const size_t RING_SPINS = 1 << 14;          // checks before going to sleep
+
+struct RingRequest {
+    uint64_t    tag;                // handed back in the completion
+    uint32_t    length;
+    char        text[244];          // STATUS::BAD_REQUEST if it won't fit
+};
+
+struct RingCompletion {
+    uint64_t    tag;
+    int64_t     result;
+    STATUS      status;
+};
+
+// The counters each side writes are kept on cache lines of their own.
+struct Ring {
+    atomic<uint32_t>    sq_head;        // written by the worker
+    atomic<uint32_t>    sq_sleeping;    // the worker is waiting for sq_tail
+    char                _pad1[56];
+    atomic<uint32_t>    sq_tail;        // written by the client
+    atomic<uint32_t>    cq_sleeping;    // the client is waiting for cq_tail
+    atomic<uint32_t>    owner;          // pid of the client, 0 if none
+    char                _pad2[52];
+    atomic<uint32_t>    cq_head;        // written by the client
+    char                _pad3[60];
+    atomic<uint32_t>    cq_tail;        // written by the worker
+    char                _pad4[60];
+    RingRequest         sq[RING_ENTRIES];
+    RingCompletion      cq[RING_ENTRIES];
+};
+
+struct RingHeader {
+    uint32_t    magic;
+    uint32_t    rings;
+    char        _pad[56];
+};
+
+// Sleep until word no longer holds value.  The futexes are shared between
+// processes so they can't be FUTEX_PRIVATE.
+void futex_wait(atomic<uint32_t>& word, uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value,
+        nullptr, nullptr, 0);
+}
+
+void futex_wake(atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1,
+        nullptr, nullptr, 0);
+}
+
+// Wait for word to move on from value, spinning for a while before going to
+// sleep.  sleeping is set while asleep so that whoever moves word knows to
+// call futex_wake().  With only one CPU nobody can move word while we spin,
+// so we go straight to sleep.
+uint32_t await(atomic<uint32_t>& word, atomic<uint32_t>& sleeping,
+uint32_t value) {
+    static const size_t spins = thread::hardware_concurrency() > 1 ?
+        RING_SPINS : 0;
+
+    for (size_t i = 0; i < spins; i++) {
+        uint32_t now = word.load(memory_order_acquire);
+        if (now != value) {
+            return now;
+        }
+    }
+
+    while (true) {
+        sleeping.store(1, memory_order_seq_cst);
+        uint32_t now = word.load(memory_order_seq_cst);
+        if (now != value) {
+            sleeping.store(0, memory_order_relaxed);
+            return now;
+        }
+        futex_wait(word, value);
+        sleeping.store(0, memory_order_relaxed);
+    }
+}
+
+// Store value in word and wake whoever is waiting for it.
+void publish(atomic<uint32_t>& word, atomic<uint32_t>& sleeping,
+uint32_t value) {
+    word.store(value, memory_order_seq_cst);
+    if (sleeping.load(memory_order_seq_cst)) {
+        futex_wake(word);
+    }
+}
+
+// Map the file at path, creating it with room for rings rings if rings is
+// not 0.
+RingHeader* map_rings(const string& path, uint32_t rings, size_t& size) {
+    int fd = open(path.c_str(), rings ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC :
+        O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        error("Can't open " + path + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    if (rings) {
+        size = sizeof(RingHeader) + rings * sizeof(Ring);
+        if (ftruncate(fd, static_cast<off_t>(size)) < 0) {
+            ::close(fd);
+            error("Can't size " + path + ": " + strerror(errno));
+        }
+    } else if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >=
+    sizeof(RingHeader)) {
+        size = static_cast<size_t>(st.st_size);
+    } else {
+        ::close(fd);
+        error(path + " is not a calc6 ring file");
+    }
+
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        error("Can't map " + path + ": " + strerror(errno));
+    }
+
+    RingHeader* header = static_cast<RingHeader*>(ptr);
+    if (rings) {
+        // A new file is all zeroes, which is an empty ring.
+        header->rings = rings;
+        header->magic = RING_MAGIC;
+    } else if (header->magic != RING_MAGIC ||
+    size < sizeof(RingHeader) + header->rings * sizeof(Ring)) {
+        munmap(ptr, size);
+        error(path + " is not a calc6 ring file");
+    }
+
+    return header;
+}
+
+Ring* ring_at(RingHeader* header, uint32_t n) {
+    return reinterpret_cast<Ring*>(reinterpret_cast<char*>(header + 1) +
+        n * sizeof(Ring));
+}
+
+// Serves the rings in a file, one worker thread per ring.
+class RingServer {
+public:
+    RingServer(const string& path, uint32_t workers);
+    void run();
+private:
+    RingHeader*     _header;
+    size_t          _size;
+    vector<thread>  _workers;
+
+    void    work(Ring* ring);
+};
+
+// Constructor
+RingServer::RingServer(const string& path, uint32_t workers) :
+_header{nullptr}, _size{0}, _workers{} {
+    _header = map_rings(path, workers, _size);
+}
+
+// Serve every ring.  It never returns.
+void RingServer::run() {
+    for (uint32_t i = 1; i < _header->rings; i++) {
+        _workers.emplace_back(&RingServer::work, this, ring_at(_header, i));
+    }
+    work(ring_at(_header, 0));
+}
+
+// Evaluate everything submitted to ring, a batch at a time.
+void RingServer::work(Ring* ring) {
+    static thread_local string text;
+    uint32_t head = ring->sq_head.load(memory_order_relaxed);
+    uint32_t completed = ring->cq_tail.load(memory_order_relaxed);
+
+    while (true) {
+        uint32_t tail = await(ring->sq_tail, ring->sq_sleeping, head);
+
+        for (; head != tail; head++) {
+            const RingRequest& request = ring->sq[head % RING_ENTRIES];
+            RingCompletion& completion = ring->cq[completed++ % RING_ENTRIES];
+            completion.tag = request.tag;
+            completion.result = 0;
+            if (request.length > sizeof(request.text)) {
+                completion.status = STATUS::BAD_REQUEST;
+                continue;
+            }
+            text.assign(request.text, request.length);
+            try {
+                completion.result = calculate(text);
+                completion.status = STATUS::OK;
+            }
+            catch(const char* error) {
+                completion.status = status_of(error);
+            }
+        }
+
+        ring->sq_head.store(head, memory_order_release);
+        publish(ring->cq_tail, ring->cq_sleeping, completed);
+    }
+}
+
+// Claim ring n, or the first free ring if n is RING_ANY, for this process
+// and return it, or nullptr if it is taken.  A ring whose owner has died is
+// free, but whatever the owner left outstanding is waited for and thrown
+// away so that its results aren't taken for ours.
+Ring* claim_ring(RingHeader* header, uint32_t n) {
+    uint32_t self = static_cast<uint32_t>(getpid());
+
+    for (uint32_t i = n == RING_ANY ? 0 : n; i < header->rings; i++) {
+        Ring* ring = ring_at(header, i);
+        uint32_t owner = ring->owner.load(memory_order_relaxed);
+        bool free = owner == 0 ||
+            (kill(static_cast<pid_t>(owner), 0) < 0 && errno == ESRCH);
+        if (free && ring->owner.compare_exchange_strong(owner, self,
+        memory_order_acquire)) {
+            uint32_t tail = ring->sq_tail.load(memory_order_relaxed);
+            uint32_t head = ring->cq_head.load(memory_order_relaxed);
+            while (head != tail) {
+                head = await(ring->cq_tail, ring->cq_sleeping, head);
+            }
+            ring->cq_head.store(head, memory_order_release);
+            return ring;
+        }
+        if (n != RING_ANY) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+// Evaluate each line of in on ring n of the file at path, or any free ring
+// if n is RING_ANY, submitting as many lines at a time as the ring will hold,
+// and write the results to out.
+void ring_client(const string& path, uint32_t n, istream& in, ostream& out) {
+    size_t size;
+    RingHeader* header = map_rings(path, 0, size);
+    if (n != RING_ANY && n >= header->rings) {
+        munmap(header, size);
+        error(path + " has no ring " + to_string(n));
+    }
+    Ring* ring = claim_ring(header, n);
+    if (ring == nullptr) {
+        munmap(header, size);
+        error(n == RING_ANY ? path + " has no free ring" :
+            path + " ring " + to_string(n) + " is in use");
+    }
+    uint32_t tail = ring->sq_tail.load(memory_order_relaxed);
+    uint32_t head = ring->cq_head.load(memory_order_relaxed);
+    string line;
+    string output;
+
+    while (in) {
+        while (tail - head < RING_ENTRIES && getline(in, line)) {
+            RingRequest& request = ring->sq[tail % RING_ENTRIES];
+            request.tag = tail;
+            request.length = static_cast<uint32_t>(line.length());
+            memcpy(request.text, line.data(),
+                min(line.length(), sizeof(request.text)));
+            tail++;
+        }
+        publish(ring->sq_tail, ring->sq_sleeping, tail);
+
+        while (head != tail) {
+            uint32_t completed = await(ring->cq_tail, ring->cq_sleeping, head);
+            for (; head != completed; head++) {
+                const RingCompletion& completion =
+                    ring->cq[head % RING_ENTRIES];
+                switch(completion.status) {
+                    case STATUS::OK:
+                        put_decimal(output, completion.result);
+                        break;
+                    case STATUS::DIVISION_BY_ZERO:
+                        output += "Division by zero";
+                        break;
+                    case STATUS::PARSE_ERROR:
+                        output += "Error parsing input";
+                        break;
+                    default:
+                        output += "Line too long";
+                        break;
+                }
+                output += '\n';
+            }
+            ring->cq_head.store(head, memory_order_release);
+        }
+        out << output;
+        output.clear();
+    }
+
+    out.flush();
+    ring->owner.store(0, memory_order_release);
+    munmap(header, size);
+}
+
+// Most threads -j will start, or rings --serve-shm will make.
+const size_t MAXJOBS = 1024;
+
+void usage(const char* name) {
+    cerr << "usage: " << name
+        << " [--batch | --pipeline | -j N | --incremental | --serve ADDRESS"
+        << " | --serve-binary ADDRESS | --serve-http ADDRESS"
+        << " | --serve-shm FILE | --connect-shm FILE[:RING]"
+        << " | --profile-workload] [--metrics ADDRESS]"
+        << " [--reader getline|read|uring] [--writer write|ostream]"
+        << " [--columns FILE] [--memo SLOTS] [--stats] [--counters]"
+        << " [--trace=FILE [--trace-calls]] [--assert-no-alloc]"
+        << " [--slow-log MICROSECONDS [--slow-log-fd FD]"
+        << " [--slow-log-rate N]]" << endl;
+    cerr << "--reader, --writer and --columns only go with --batch, and not"
+        << " with -j or --pipeline" << endl;
+    cerr << "--writer ostream reads with getline and can't be used with"
+        << " --reader read|uring or --columns" << endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    size_t jobs = 0;
+    bool batched = false;
+    string reader = "getline";
+    string writer = "write";
+    string output;
+    bool io = false;        // --reader, --writer or --columns was given
+    bool pipelined = false;
+    bool edits = false;
+    bool profiled = false;
+    vector<pair<string, PROTOCOL>> addresses;
+    string rings;
+    string ring;
+    size_t slots = 0;
+    bool stats = false;
+    bool counters = false;
+    string trace;
+    bool calls = false;
+    uint64_t slow = 0;
+    int slow_fd = STDERR_FILENO;
+    size_t slow_rate = 100;
+
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "-j" && i + 1 < argc) {
+            if (!parse_number(argv[++i], MAXJOBS, jobs) || jobs == 0) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--batch") {
+            batched = true;
+        } else if (arg == "--reader" && i + 1 < argc) {
+            reader = argv[++i];
+            io = true;
+            if (reader != "getline" && reader != "read" && reader != "uring") {
+                usage(argv[0]);
+            }
+        } else if (arg == "--writer" && i + 1 < argc) {
+            writer = argv[++i];
+            io = true;
+            if (writer != "write" && writer != "ostream") {
+                usage(argv[0]);
+            }
+        } else if (arg == "--columns" && i + 1 < argc) {
+            output = argv[++i];
+            io = true;
+        } else if (arg == "--pipeline") {
+            pipelined = true;
+        } else if (arg == "--incremental") {
+            edits = true;
+        } else if (arg == "--profile-workload") {
+            profiled = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            addresses.emplace_back(argv[++i], PROTOCOL::LINES);
+        } else if (arg == "--serve-binary" && i + 1 < argc) {
+            addresses.emplace_back(argv[++i], PROTOCOL::FRAMES);
+        } else if (arg == "--serve-http" && i + 1 < argc) {
+            addresses.emplace_back(argv[++i], PROTOCOL::HTTP);
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            addresses.emplace_back(argv[++i], PROTOCOL::METRICS);
+        } else if (arg == "--serve-shm" && i + 1 < argc) {
+            rings = argv[++i];
+        } else if (arg == "--connect-shm" && i + 1 < argc) {
+            ring = argv[++i];
+        } else if (arg == "--memo" && i + 1 < argc) {
+            if (!parse_number(argv[++i], Memo::MAXSLOTS, slots) ||
+            slots == 0) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--counters") {
+            stats = counters = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (arg.compare(0, 8, "--trace=") == 0 && arg.length() > 8) {
+            trace = arg.substr(8);
+        } else if (arg == "--trace-calls") {
+            calls = true;
+        } else if (arg == "--slow-log" && i + 1 < argc) {
+            unsigned long number;
+            if (!parse_number(argv[++i], ULONG_MAX / 1000, number) ||
+            number == 0) {
+                usage(argv[0]);
+            }
+            slow = number;
+        } else if (arg == "--slow-log-fd" && i + 1 < argc) {
+            unsigned long number;
+            if (!parse_number(argv[++i], INT_MAX, number)) {
+                usage(argv[0]);
+            }
+            slow_fd = static_cast<int>(number);
+            if (fcntl(slow_fd, F_GETFD) < 0) {
+                cerr << "Can't log slow lines to descriptor " << slow_fd
+                    << ": " << strerror(errno) << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--slow-log-rate" && i + 1 < argc) {
+            if (!parse_number(argv[++i], ULONG_MAX, slow_rate) ||
+            slow_rate == 0) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--assert-no-alloc") {
+            if (!COUNTING_ALLOCATIONS) {
+                cerr << "--assert-no-alloc needs a build which counts"
+                    << " allocations (make calc6-alloc)" << endl;
+                return EXIT_FAILURE;
+            }
+            Stats::assert_no_alloc = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // Batch mode is all that reads and writes for itself; anything else
+    // would silently ignore how it was asked to.
+    if (io && (!batched || jobs || pipelined || edits || profiled ||
+    !addresses.empty() || !rings.empty() || !ring.empty())) {
+        usage(argv[0]);
+    }
+
+    // The ostream writer is the REPL's way of reading and writing, so it
+    // goes with getline and nothing else.
+    if (writer == "ostream" && (reader != "getline" || !output.empty())) {
+        cerr << "--writer ostream only works with --reader getline and"
+            << " without --columns" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (slow) {
+        Stats::log_slow(slow * 1000, slow_fd, slow_rate);
+    }
+    if (stats || slow) {
+        Stats::reporting = stats;
+        Stats::start(counters);
+    }
+    if (!trace.empty()) {
+        Trace::start(trace, calls);
+    }
+
+    unique_ptr<Memo> memo;
+    if (slots) {
+        memo.reset(new Memo(slots));
+        Tree::memo = memo.get();
+    }
+
+    if (!addresses.empty()) {
+        // Serve until killed.  -j sets the number of workers.
+        Lexer::trace = false;
+        try {
+            Server server(jobs ? jobs :
+                max(thread::hardware_concurrency(), 1u));
+            for (auto& address : addresses) {
+                server.listen(address.first, address.second);
+            }
+            server.run();
+        }
+        catch(const char* error) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!rings.empty()) {
+        // One worker per ring; -j sets how many.
+        Lexer::trace = false;
+        try {
+            RingServer server(rings, static_cast<uint32_t>(jobs ? jobs :
+                max(thread::hardware_concurrency(), 1u)));
+            server.run();
+        }
+        catch(const char* error) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!ring.empty()) {
+        uint32_t n = RING_ANY;
+        size_t colon = ring.rfind(':');
+        if (colon != string::npos) {
+            const char* digits = ring.c_str() + colon + 1;
+            char* end;
+            errno = 0;
+            unsigned long number = strtoul(digits, &end, 10);
+            if (!isdigit(static_cast<unsigned char>(*digits)) || *end ||
+            errno || number >= RING_ANY) {
+                usage(argv[0]);
+            }
+            n = static_cast<uint32_t>(number);
+            ring.erase(colon);
+        }
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        try {
+            ring_client(ring, n, cin, cout);
+        }
+        catch(const char* error) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+    } else if (edits) {
+        Lexer::trace = false;
+        incremental(cin, cout);
+    } else if (profiled) {
+        // Nothing is evaluated; the report is the output.
+        Lexer::trace = false;
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        unique_ptr<WorkloadProfile> profile(new WorkloadProfile);
+        string line;
+        while (getline(cin, line)) {
+            profile->add(line);
+        }
+        profile->dump(cout);
+    } else if (jobs) {
+        // Evaluate lines in parallel.  The token trace would be interleaved
+        // from all the workers and be no use to anyone so it is turned off.
+        Lexer::trace = false;
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        ParallelEvaluator evaluator(jobs);
+        evaluator.run(cin, cout);
+    } else if (pipelined) {
+        Lexer::trace = false;
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        Pipeline pipeline;
+        pipeline.run(cin, cout);
+        if (stats) {
+            pipeline.dump(cerr);
+        }
+    } else if (batched) {
+        Lexer::trace = false;
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+
+        auto start = chrono::steady_clock::now();
+        Tally tally;
+        unique_ptr<ColumnWriter> columns;
+        try {
+            if (!output.empty()) {
+                columns.reset(new ColumnWriter(output));
+            }
+            if (writer == "ostream" && !columns) {
+                tally = batch(cin, cout);
+            } else if (reader == "getline") {
+                tally = batch(cin, STDOUT_FILENO, columns.get());
+            } else {
+                unique_ptr<Source> source;
+                if (reader == "uring") {
+                    try {
+                        source.reset(new UringSource(STDIN_FILENO));
+                    }
+                    catch(const char* error) {
+                        if (stats) {
+                            cerr << error << "; using read()" << endl;
+                        }
+                        reader = "read";
+                    }
+                }
+                if (!source) {
+                    source.reset(new FdSource(STDIN_FILENO));
+                }
+                tally = batch(*source, STDOUT_FILENO, columns.get());
+            }
+            if (columns) {
+                columns->finish();
+            }
+        }
+        catch(const char* error) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+        double seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+
+        if (stats) {
+            cerr << "batch: " << (writer == "ostream" ? writer : reader)
+                << ", " << tally.lines << " lines, "
+                << tally.bytes << " bytes in " << fixed << setprecision(3)
+                << seconds << "s, " << setprecision(0)
+                << tally.lines / seconds << " lines/s, " << setprecision(1)
+                << tally.bytes / seconds / 1e6 << " MB/s" << endl;
+        }
+    } else {
+        string text;
+        while(cin) {
+            cout << "calc> ";
+            getline(cin, text);
+
+            if (text.compare(0, 9, ":explain ") == 0) {
+                text.erase(0, 9);
+                explain(text, cout);
+                continue;
+            } else if (text.compare(0, 7, ":bench ") == 0) {
+                text.erase(0, 7);
+                bench(text, cout);
+                continue;
+            }
+
+            bool failed = false;
+            calculate_each(text, [&failed](long result, const char* error) {
+                if (error) {
+                    cerr << error << endl;
+                    failed = true;
+                } else {
+                    cout << result << endl;
+                }
+            });
+            if (failed) {
+                break;
+            }
+        }
+    }
+
+    if (stats && memo) {
+        memo->dump(cerr);
+    }
+    report();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Scripted client for calc6's servers, used by make check.
+#
+#   client.py lines SOCKET      send standard input, print what comes back
+#   client.py frames SOCKET     send each line as an EXPRESSION frame
+#   client.py tokens SOCKET     send each line, lexed here, as a TOKENS frame
+#   client.py http SOCKET       POST standard input to /eval
+#   client.py metrics SOCKET    GET the metrics
+#
+# Frame responses are printed as the status and the result.  HTTP responses
+# are printed with the status line and body but no other headers.
+
+import re
+import socket
+import struct
+import sys
+import time
+
+TOKENTYPES = {'+': 2, '-': 3, '*': 4, '/': 5, '(': 6, ')': 7, ';': 8}
+
+
+# Connect to the socket at path, waiting up to five seconds for the server
+# to start listening.
+def connect(path):
+    for attempt in range(50):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            s.connect(path)
+            return s
+        except (FileNotFoundError, ConnectionRefusedError):
+            s.close()
+            time.sleep(0.1)
+    sys.exit('Can\'t connect to ' + path)
+
+
+def receive(s):
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            return data
+        data += chunk
+
+
+def frame(kind, body):
+    return struct.pack('<IB', len(body) + 1, kind) + body
+
+
+def tokens(line):
+    body = b''
+    for token in re.findall(rb'\d+|[-+*/();]', line):
+        if token.isdigit():
+            body += struct.pack('<BQ', 1, int(token) % 2**64)
+        else:
+            body += struct.pack('<BQ', TOKENTYPES[token.decode()], 0)
+    return body
+
+
+def framed(s, lines, kind, encode):
+    s.sendall(b''.join(frame(kind, encode(line)) for line in lines))
+    s.shutdown(socket.SHUT_WR)
+    data = receive(s)
+    for i in range(0, len(data), 13):
+        length, status, result = struct.unpack('<IBq', data[i:i + 13])
+        print(status, result)
+
+
+def http(s, request):
+    s.sendall(request)
+    s.shutdown(socket.SHUT_WR)
+    head, _, body = receive(s).partition(b'\r\n\r\n')
+    sys.stdout.write(head.split(b'\r\n')[0].decode() + '\n')
+    sys.stdout.write(body.decode())
+
+
+def main():
+    protocol, path = sys.argv[1:3]
+    s = connect(path)
+    text = sys.stdin.buffer.read() if protocol != 'metrics' else b''
+    lines = text.splitlines()
+    if protocol == 'lines':
+        s.sendall(text)
+        s.shutdown(socket.SHUT_WR)
+        sys.stdout.write(receive(s).decode())
+    elif protocol == 'frames':
+        framed(s, lines, 0, lambda line: line)
+    elif protocol == 'tokens':
+        framed(s, lines, 1, tokens)
+    elif protocol == 'http':
+        http(s, b'POST /eval HTTP/1.1\r\nHost: calc6\r\nContent-Length: %d'
+            b'\r\nConnection: close\r\n\r\n' % len(text) + text)
+    elif protocol == 'metrics':
+        http(s, b'GET /metrics HTTP/1.1\r\nHost: calc6\r\n'
+            b'Connection: close\r\n\r\n')
+    else:
+        sys.exit('unknown protocol ' + protocol)
+
+
+main()
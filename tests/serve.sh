@@ -0,0 +1,49 @@
+#!/bin/sh
+# Check calc6's servers: tests/check.in over each protocol with
+# tests/client.py, the metrics afterwards, then over shared memory rings.
+# Usage: serve.sh CALC6
+
+calc6=$1
+tests=`dirname "$0"`
+dir=`mktemp -d` || exit 1
+server=
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+set -e
+
+# Run a client for protocol on check.in and compare what comes back with
+# expected.
+check() {
+    echo "calc6 $1"
+    python3 "$tests/client.py" $2 "$dir/$2" < "$tests/check.in" | \
+        diff "$tests/$3" -
+}
+
+"$calc6" -j 2 --serve "$dir/lines" --serve-binary "$dir/frames" \
+    --serve-binary "$dir/tokens" --serve-http "$dir/http" \
+    --metrics "$dir/metrics" &
+server=$!
+check --serve lines check.out
+check --serve-binary frames frames.out
+check --serve-binary tokens tokens.out
+check --serve-http http http.out
+echo "calc6 --metrics"
+python3 "$tests/client.py" metrics "$dir/metrics" > "$dir/scraped"
+grep -qx 'HTTP/1.1 200 OK' "$dir/scraped"
+grep -qx 'calc6_requests_total 67' "$dir/scraped"
+grep -qx 'calc6_errors_total{kind="division_by_zero"} 6' "$dir/scraped"
+kill $server
+wait $server || true
+
+echo "calc6 --serve-shm"
+"$calc6" -j 2 --serve-shm "$dir/rings" &
+server=$!
+tries=0
+until "$calc6" --connect-shm "$dir/rings" < "$tests/check.in" \
+> "$dir/shm" 2> /dev/null; do
+    tries=`expr $tries + 1`
+    test $tries -lt 50
+    sleep 0.1
+done
+diff "$tests/shm.out" "$dir/shm"
+"$calc6" --connect-shm "$dir/rings:1" < "$tests/check.in" | \
+    diff "$tests/shm.out" -